@@ -0,0 +1,448 @@
+/*
+ * Copyright © 2008 Kristian Høgsberg
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+/* Microbenchmark for the wire path: marshal a message, queue it on a
+ * connection, send it over a socketpair, demarshal it on the other end
+ * and invoke a handler.  Each stage is timed separately and the
+ * results are printed as JSON on stdout. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "wayland-util.h"
+#include "wayland-server-protocol.h"
+#include "connection.h"
+
+#define BATCH_SIZE 64
+
+enum stage {
+	STAGE_MARSHAL,
+	STAGE_SEND,
+	STAGE_DEMARSHAL,
+	STAGE_INVOKE,
+	STAGE_COUNT
+};
+
+static const char *stage_names[] = {
+	"vmarshal", "send", "demarshal", "invoke"
+};
+
+struct bench {
+	struct wl_connection *sender, *receiver;
+	struct wl_map objects;
+	struct wl_object target, object;
+	struct wl_array array;
+	int fd;
+	uint64_t ns[STAGE_COUNT];
+	uint64_t overhead;
+};
+
+struct bench_case {
+	const char *name;
+	const struct wl_interface *interface;
+	int event;
+	const char *message;
+	struct wl_closure *(*marshal)(struct bench *bench, uint32_t opcode,
+				      const struct wl_message *message);
+	void (*handler)(void);
+};
+
+static int
+update_func(struct wl_connection *connection, uint32_t mask, void *data)
+{
+	return 0;
+}
+
+static inline uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct wl_closure *
+vmarshal(struct bench *bench, uint32_t opcode,
+	 const struct wl_message *message, ...)
+{
+	struct wl_closure *closure;
+	va_list ap;
+
+	va_start(ap, message);
+	closure = wl_connection_vmarshal(bench->sender, &bench->target,
+					 opcode, ap, message);
+	va_end(ap);
+
+	return closure;
+}
+
+static struct wl_closure *
+marshal_u(struct bench *bench, uint32_t opcode,
+	  const struct wl_message *message)
+{
+	return vmarshal(bench, opcode, message, 2);
+}
+
+static struct wl_closure *
+marshal_iiii(struct bench *bench, uint32_t opcode,
+	     const struct wl_message *message)
+{
+	return vmarshal(bench, opcode, message, 10, 20, 640, 480);
+}
+
+static struct wl_closure *
+marshal_usu(struct bench *bench, uint32_t opcode,
+	    const struct wl_message *message)
+{
+	return vmarshal(bench, opcode, message,
+			7, "wl_input_device", 1);
+}
+
+static struct wl_closure *
+marshal_oii(struct bench *bench, uint32_t opcode,
+	    const struct wl_message *message)
+{
+	return vmarshal(bench, opcode, message, &bench->object, 0, 0);
+}
+
+static struct wl_closure *
+marshal_n(struct bench *bench, uint32_t opcode,
+	  const struct wl_message *message)
+{
+	struct wl_object new_object = { NULL, NULL, 3 };
+
+	return vmarshal(bench, opcode, message, &new_object);
+}
+
+static struct wl_closure *
+marshal_uoa(struct bench *bench, uint32_t opcode,
+	    const struct wl_message *message)
+{
+	return vmarshal(bench, opcode, message,
+			1234, &bench->object, &bench->array);
+}
+
+static struct wl_closure *
+marshal_nhiiuu(struct bench *bench, uint32_t opcode,
+	       const struct wl_message *message)
+{
+	struct wl_object new_object = { NULL, NULL, 3 };
+
+	return vmarshal(bench, opcode, message,
+			&new_object, bench->fd, 640, 480, 2560, 2);
+}
+
+static void
+handle_u(void *data, void *target, uint32_t u)
+{
+}
+
+static void
+handle_iiii(void *data, void *target,
+	    int32_t x, int32_t y, int32_t width, int32_t height)
+{
+}
+
+static void
+handle_usu(void *data, void *target,
+	   uint32_t name, const char *interface, uint32_t version)
+{
+}
+
+static void
+handle_oii(void *data, void *target, void *object, int32_t x, int32_t y)
+{
+}
+
+static void
+handle_n(void *data, void *target, uint32_t id)
+{
+}
+
+static void
+handle_uoa(void *data, void *target,
+	   uint32_t time, void *object, struct wl_array *keys)
+{
+}
+
+static void
+handle_nhiiuu(void *data, void *target, uint32_t id, int fd,
+	      int32_t width, int32_t height, uint32_t stride, uint32_t format)
+{
+	close(fd);
+}
+
+/* One representative message per signature shape, together covering
+ * every argument type in the protocol. */
+static const struct bench_case cases[] = {
+	{ "shm.format", &wl_shm_interface, 1, "format",
+	  marshal_u, (void (*)(void)) handle_u },
+	{ "surface.damage", &wl_surface_interface, 0, "damage",
+	  marshal_iiii, (void (*)(void)) handle_iiii },
+	{ "display.global", &wl_display_interface, 1, "global",
+	  marshal_usu, (void (*)(void)) handle_usu },
+	{ "surface.attach", &wl_surface_interface, 0, "attach",
+	  marshal_oii, (void (*)(void)) handle_oii },
+	{ "display.sync", &wl_display_interface, 0, "sync",
+	  marshal_n, (void (*)(void)) handle_n },
+	{ "input_device.keyboard_focus", &wl_input_device_interface, 1,
+	  "keyboard_focus", marshal_uoa, (void (*)(void)) handle_uoa },
+	{ "shm.create_buffer", &wl_shm_interface, 0, "create_buffer",
+	  marshal_nhiiuu, (void (*)(void)) handle_nhiiuu },
+};
+
+static int
+find_message(const struct bench_case *c, const struct wl_message **message)
+{
+	const struct wl_message *messages;
+	int i, count;
+
+	if (c->event) {
+		messages = c->interface->events;
+		count = c->interface->event_count;
+	} else {
+		messages = c->interface->methods;
+		count = c->interface->method_count;
+	}
+
+	for (i = 0; i < count; i++)
+		if (strcmp(messages[i].name, c->message) == 0) {
+			*message = &messages[i];
+			return i;
+		}
+
+	return -1;
+}
+
+static int
+run_batch(struct bench *bench, const struct bench_case *c,
+	  uint32_t opcode, const struct wl_message *message, int count)
+{
+	struct wl_closure *closure;
+	uint32_t p[2], size;
+	uint64_t t0, t1, t2;
+	int i, len;
+
+	for (i = 0; i < count; i++) {
+		t0 = now();
+		closure = c->marshal(bench, opcode, message);
+		t1 = now();
+		if (closure == NULL) {
+			fprintf(stderr, "%s: marshal failed: %m\n", c->name);
+			return -1;
+		}
+		if (wl_closure_send(closure, bench->sender) < 0) {
+			fprintf(stderr, "%s: send failed: %m\n", c->name);
+			return -1;
+		}
+		t2 = now();
+		wl_closure_destroy(closure);
+
+		bench->ns[STAGE_MARSHAL] += t1 - t0 - bench->overhead;
+		bench->ns[STAGE_SEND] += t2 - t1 - bench->overhead;
+	}
+
+	t0 = now();
+	if (wl_connection_data(bench->sender, WL_CONNECTION_WRITABLE) < 0)
+		return -1;
+	len = wl_connection_data(bench->receiver, WL_CONNECTION_READABLE);
+	t1 = now();
+	if (len < 0)
+		return -1;
+	bench->ns[STAGE_SEND] += t1 - t0 - bench->overhead;
+
+	for (i = 0; i < count; i++) {
+		/* recvmsg stops at each batch of passed fds, so messages
+		 * carrying fds may take several reads. */
+		for (;;) {
+			if (len >= sizeof p) {
+				wl_connection_copy(bench->receiver,
+						   p, sizeof p);
+				if (len >= (p[1] >> 16))
+					break;
+			}
+
+			t0 = now();
+			len = wl_connection_data(bench->receiver,
+						 WL_CONNECTION_READABLE);
+			t1 = now();
+			if (len < 0)
+				return -1;
+			bench->ns[STAGE_SEND] += t1 - t0 - bench->overhead;
+		}
+
+		size = p[1] >> 16;
+
+		t0 = now();
+		closure = wl_connection_demarshal(bench->receiver, size,
+						  &bench->objects, message);
+		t1 = now();
+		if (closure == NULL) {
+			fprintf(stderr, "%s: demarshal failed: %m\n", c->name);
+			return -1;
+		}
+		wl_closure_invoke(closure, &bench->target, c->handler, bench);
+		t2 = now();
+		wl_closure_destroy(closure);
+		len -= size;
+
+		bench->ns[STAGE_DEMARSHAL] += t1 - t0 - bench->overhead;
+		bench->ns[STAGE_INVOKE] += t2 - t1 - bench->overhead;
+	}
+
+	return 0;
+}
+
+static int
+run_case(struct bench *bench, const struct bench_case *c, int iterations)
+{
+	const struct wl_message *message;
+	uint64_t total;
+	int opcode, i, done, count;
+
+	opcode = find_message(c, &message);
+	if (opcode < 0) {
+		fprintf(stderr, "%s: no such message\n", c->name);
+		return -1;
+	}
+
+	memset(bench->ns, 0, sizeof bench->ns);
+	for (done = 0; done < iterations; done += count) {
+		count = iterations - done;
+		if (count > BATCH_SIZE)
+			count = BATCH_SIZE;
+		if (run_batch(bench, c, opcode, message, count) < 0)
+			return -1;
+	}
+
+	printf("    { \"name\": \"%s\", \"signature\": \"%s\", "
+	       "\"iterations\": %d,\n",
+	       c->name, message->signature, iterations);
+
+	total = 0;
+	for (i = 0; i < STAGE_COUNT; i++) {
+		total += bench->ns[i];
+		printf("      \"%s\": { \"ns_per_msg\": %.1f, "
+		       "\"msgs_per_sec\": %.0f },\n",
+		       stage_names[i],
+		       (double) bench->ns[i] / iterations,
+		       bench->ns[i] ?
+		       iterations * 1e9 / bench->ns[i] : 0.0);
+	}
+
+	printf("      \"total\": { \"ns_per_msg\": %.1f, "
+	       "\"msgs_per_sec\": %.0f } }",
+	       (double) total / iterations,
+	       total ? iterations * 1e9 / total : 0.0);
+
+	return 0;
+}
+
+static uint64_t
+timer_overhead(void)
+{
+	uint64_t t0, t1, min;
+	int i;
+
+	min = UINT64_MAX;
+	for (i = 0; i < 1000; i++) {
+		t0 = now();
+		t1 = now();
+		if (t1 - t0 < min)
+			min = t1 - t0;
+	}
+
+	return min;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench bench;
+	uint32_t *keys;
+	int fds[2], i, iterations;
+
+	iterations = 100000;
+	if (argc > 1)
+		iterations = strtol(argv[1], NULL, 0);
+	if (iterations <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+		fprintf(stderr, "socketpair failed: %m\n");
+		return 1;
+	}
+
+	memset(&bench, 0, sizeof bench);
+	bench.sender = wl_connection_create(fds[0], update_func, &bench);
+	bench.receiver = wl_connection_create(fds[1], update_func, &bench);
+	if (bench.sender == NULL || bench.receiver == NULL) {
+		fprintf(stderr, "failed to create connections\n");
+		return 1;
+	}
+
+	bench.target.id = 1;
+	bench.object.id = 2;
+	wl_map_init(&bench.objects);
+	wl_map_insert_at(&bench.objects, 0, NULL);
+	wl_map_insert_at(&bench.objects, 1, &bench.target);
+	wl_map_insert_at(&bench.objects, 2, &bench.object);
+
+	wl_array_init(&bench.array);
+	keys = wl_array_add(&bench.array, 4 * sizeof *keys);
+	for (i = 0; i < 4; i++)
+		keys[i] = 30 + i;
+
+	bench.fd = fds[0];
+	bench.overhead = timer_overhead();
+
+	printf("{\n  \"iterations\": %d,\n  \"timer_overhead_ns\": %llu,\n"
+	       "  \"results\": [\n",
+	       iterations, (unsigned long long) bench.overhead);
+
+	for (i = 0; i < ARRAY_LENGTH(cases); i++) {
+		if (run_case(&bench, &cases[i], iterations) < 0)
+			return 1;
+		printf("%s\n", i + 1 < ARRAY_LENGTH(cases) ? "," : "");
+	}
+
+	printf("  ]\n}\n");
+
+	wl_array_release(&bench.array);
+	wl_map_release(&bench.objects);
+	wl_connection_destroy(bench.sender);
+	wl_connection_destroy(bench.receiver);
+
+	return 0;
+}
@@ -40,22 +40,31 @@
 #include "connection.h"
 
 #define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define WL_BUFFER_INITIAL_SIZE 4096
+#define WL_BUFFER_DEFAULT_MAX_SIZE (256 * 1024)
 
 struct wl_buffer {
-	char data[4096];
-	int head, tail;
+	char *data;
+	uint32_t size, max_size;
+	uint32_t head, tail;
+	struct wl_array pins;
 };
 
-#define MASK(i) ((i) & 4095)
+#define MASK(b, i) ((i) & ((b)->size - 1))
 
 struct wl_closure {
 	int count;
 	const struct wl_message *message;
-	ffi_type *types[20];
+	ffi_type *types[WL_CLOSURE_MAX_ARGS];
 	ffi_cif cif;
-	void *args[20];
-	uint32_t buffer[64];
+	void *args[WL_CLOSURE_MAX_ARGS];
+	uint32_t *buffer;
+	size_t buffer_size;
 	uint32_t *start;
+	struct wl_buffer *pin;
+	int pin_depth;
 };
 
 struct wl_connection {
@@ -75,16 +84,63 @@ union wl_value {
 	struct wl_array *array;
 };
 
+static int
+wl_buffer_init(struct wl_buffer *b, uint32_t size, uint32_t max_size)
+{
+	b->data = malloc(size);
+	if (b->data == NULL)
+		return -1;
+
+	b->size = size;
+	b->max_size = max_size;
+	b->head = 0;
+	b->tail = 0;
+	wl_array_init(&b->pins);
+
+	return 0;
+}
+
+static int
+wl_buffer_is_pinned(struct wl_buffer *b, const char *data)
+{
+	char **p, **end;
+
+	end = (char **) ((char *) b->pins.data + b->pins.size);
+	for (p = b->pins.data; p < end; p++)
+		if (*p == data)
+			return 1;
+
+	return 0;
+}
+
+static void
+wl_buffer_release(struct wl_buffer *b)
+{
+	char **p, **end;
+
+	/* Free the retired blocks still pinned, each only once. */
+	end = (char **) ((char *) b->pins.data + b->pins.size);
+	while (b->pins.size > 0) {
+		p = --end;
+		b->pins.size -= sizeof *p;
+		if (*p && *p != b->data && !wl_buffer_is_pinned(b, *p))
+			free(*p);
+	}
+
+	wl_array_release(&b->pins);
+	free(b->data);
+}
+
 static void
 wl_buffer_put(struct wl_buffer *b, const void *data, size_t count)
 {
-	int head, size;
+	uint32_t head, size;
 
-	head = MASK(b->head);
-	if (head + count <= sizeof b->data) {
+	head = MASK(b, b->head);
+	if (head + count <= b->size) {
 		memcpy(b->data + head, data, count);
 	} else {
-		size = sizeof b->data - head;
+		size = b->size - head;
 		memcpy(b->data + head, data, size);
 		memcpy(b->data, (const char *) data + size, count - size);
 	}
@@ -95,21 +151,21 @@ wl_buffer_put(struct wl_buffer *b, const void *data, size_t count)
 static void
 wl_buffer_put_iov(struct wl_buffer *b, struct iovec *iov, int *count)
 {
-	int head, tail;
+	uint32_t head, tail;
 
-	head = MASK(b->head);
-	tail = MASK(b->tail);
+	head = MASK(b, b->head);
+	tail = MASK(b, b->tail);
 	if (head < tail) {
 		iov[0].iov_base = b->data + head;
 		iov[0].iov_len = tail - head;
 		*count = 1;
 	} else if (tail == 0) {
 		iov[0].iov_base = b->data + head;
-		iov[0].iov_len = sizeof b->data - head;
+		iov[0].iov_len = b->size - head;
 		*count = 1;
 	} else {
 		iov[0].iov_base = b->data + head;
-		iov[0].iov_len = sizeof b->data - head;
+		iov[0].iov_len = b->size - head;
 		iov[1].iov_base = b->data;
 		iov[1].iov_len = tail;
 		*count = 2;
@@ -119,21 +175,21 @@ wl_buffer_put_iov(struct wl_buffer *b, struct iovec *iov, int *count)
 static void
 wl_buffer_get_iov(struct wl_buffer *b, struct iovec *iov, int *count)
 {
-	int head, tail;
+	uint32_t head, tail;
 
-	head = MASK(b->head);
-	tail = MASK(b->tail);
+	head = MASK(b, b->head);
+	tail = MASK(b, b->tail);
 	if (tail < head) {
 		iov[0].iov_base = b->data + tail;
 		iov[0].iov_len = head - tail;
 		*count = 1;
 	} else if (head == 0) {
 		iov[0].iov_base = b->data + tail;
-		iov[0].iov_len = sizeof b->data - tail;
+		iov[0].iov_len = b->size - tail;
 		*count = 1;
 	} else {
 		iov[0].iov_base = b->data + tail;
-		iov[0].iov_len = sizeof b->data - tail;
+		iov[0].iov_len = b->size - tail;
 		iov[1].iov_base = b->data;
 		iov[1].iov_len = head;
 		*count = 2;
@@ -143,18 +199,87 @@ wl_buffer_get_iov(struct wl_buffer *b, struct iovec *iov, int *count)
 static void
 wl_buffer_copy(struct wl_buffer *b, void *data, size_t count)
 {
-	int tail, size;
+	uint32_t tail, size;
 
-	tail = MASK(b->tail);
-	if (tail + count <= sizeof b->data) {
+	tail = MASK(b, b->tail);
+	if (tail + count <= b->size) {
 		memcpy(data, b->data + tail, count);
 	} else {
-		size = sizeof b->data - tail;
+		size = b->size - tail;
 		memcpy(data, b->data + tail, size);
 		memcpy((char *) data + size, b->data, count - size);
 	}
 }
 
+static int
+wl_buffer_grow(struct wl_buffer *b, size_t count)
+{
+	uint32_t size, used;
+	char *data;
+
+	used = b->head - b->tail;
+	size = b->size;
+	while (used + count > size && size < b->max_size)
+		size *= 2;
+
+	if (used + count > size)
+		return -1;
+
+	data = malloc(size);
+	if (data == NULL)
+		return -1;
+
+	wl_buffer_copy(b, data, used);
+	/* A closure decoded in place still points into the old data,
+	 * so leave it to the last wl_buffer_unpin() to free it. */
+	if (!wl_buffer_is_pinned(b, b->data))
+		free(b->data);
+
+	b->data = data;
+	b->size = size;
+	b->tail = 0;
+	b->head = used;
+
+	return 0;
+}
+
+/* Pins nest like the dispatches that make them: each demarshal
+ * pushes one, the data it decoded in place or NULL, and its
+ * wl_closure_destroy() pops it again. */
+static int
+wl_buffer_pin(struct wl_buffer *b, char *data)
+{
+	char **p;
+
+	p = wl_array_add(&b->pins, sizeof *p);
+	if (p == NULL)
+		return -1;
+
+	*p = data;
+
+	return 0;
+}
+
+static void
+wl_buffer_unpin(struct wl_buffer *b)
+{
+	char *data;
+
+	b->pins.size -= sizeof data;
+	data = *(char **) ((char *) b->pins.data + b->pins.size);
+	if (data && data != b->data && !wl_buffer_is_pinned(b, data))
+		free(data);
+}
+
+static void
+wl_connection_release_buffers(struct wl_connection *connection)
+{
+	wl_buffer_release(&connection->in);
+	wl_buffer_release(&connection->out);
+	wl_buffer_release(&connection->fds_in);
+	wl_buffer_release(&connection->fds_out);
+}
+
 struct wl_connection *
 wl_connection_create(int fd,
 		     wl_connection_update_func_t update,
@@ -166,6 +291,20 @@ wl_connection_create(int fd,
 	if (connection == NULL)
 		return NULL;
 	memset(connection, 0, sizeof *connection);
+
+	if (wl_buffer_init(&connection->in, WL_BUFFER_INITIAL_SIZE,
+			   WL_BUFFER_DEFAULT_MAX_SIZE) < 0 ||
+	    wl_buffer_init(&connection->out, WL_BUFFER_INITIAL_SIZE,
+			   WL_BUFFER_DEFAULT_MAX_SIZE) < 0 ||
+	    wl_buffer_init(&connection->fds_in, WL_BUFFER_INITIAL_SIZE,
+			   WL_BUFFER_INITIAL_SIZE) < 0 ||
+	    wl_buffer_init(&connection->fds_out, WL_BUFFER_INITIAL_SIZE,
+			   WL_BUFFER_INITIAL_SIZE) < 0) {
+		wl_connection_release_buffers(connection);
+		free(connection);
+		return NULL;
+	}
+
 	connection->fd = fd;
 	connection->update = update;
 	connection->data = data;
@@ -181,9 +320,29 @@ void
 wl_connection_destroy(struct wl_connection *connection)
 {
 	close(connection->fd);
+	wl_connection_release_buffers(connection);
+	free(connection->receive_closure.buffer);
+	free(connection->send_closure.buffer);
 	free(connection);
 }
 
+void
+wl_connection_set_max_buffer_size(struct wl_connection *connection,
+				  size_t size)
+{
+	uint32_t max_size;
+
+	/* The rings are indexed with a mask, so round the limit down
+	 * to a power of two, but never below what is already
+	 * allocated. */
+	max_size = WL_BUFFER_INITIAL_SIZE;
+	while (max_size * 2 <= size && max_size * 2 > max_size)
+		max_size *= 2;
+
+	connection->in.max_size = MAX(max_size, connection->in.size);
+	connection->out.max_size = MAX(max_size, connection->out.size);
+}
+
 void
 wl_connection_copy(struct wl_connection *connection, void *data, size_t size)
 {
@@ -203,6 +362,9 @@ build_cmsg(struct wl_buffer *buffer, char *data, int *clen)
 	size_t size;
 
 	size = buffer->head - buffer->tail;
+	if (size > MAX_FDS_OUT * sizeof(int32_t))
+		size = MAX_FDS_OUT * sizeof(int32_t);
+
 	if (size > 0) {
 		cmsg = (struct cmsghdr *) data;
 		cmsg->cmsg_level = SOL_SOCKET;
@@ -218,10 +380,13 @@ build_cmsg(struct wl_buffer *buffer, char *data, int *clen)
 static void
 close_fds(struct wl_buffer *buffer)
 {
-	int fds[32], i, count;
+	int32_t fds[MAX_FDS_OUT];
+	int i, count;
 	size_t size;
 
 	size = buffer->head - buffer->tail;
+	if (size > sizeof fds)
+		size = sizeof fds;
 	if (size == 0)
 		return;
 
@@ -248,40 +413,49 @@ decode_cmsg(struct wl_buffer *buffer, struct msghdr *msg)
 	}
 }
 
+/* Fill in the sendmsg() arguments for whatever is queued in the out
+ * buffer.  Returns 0 if there's nothing to send. */
 int
-wl_connection_data(struct wl_connection *connection, uint32_t mask)
+wl_connection_prepare_sendmsg(struct wl_connection *connection,
+			      struct wl_connection_sendmsg *op)
 {
-	struct iovec iov[2];
-	struct msghdr msg;
-	char cmsg[128];
-	int len, count, clen;
+	int count, clen;
 
-	if (mask & WL_CONNECTION_WRITABLE) {
-		wl_buffer_get_iov(&connection->out, iov, &count);
+	if (connection->out.head == connection->out.tail)
+		return 0;
 
-		build_cmsg(&connection->fds_out, cmsg, &clen);
+	wl_buffer_get_iov(&connection->out, op->iov, &count);
+	build_cmsg(&connection->fds_out, op->cmsg, &clen);
 
-		msg.msg_name = NULL;
-		msg.msg_namelen = 0;
-		msg.msg_iov = iov;
-		msg.msg_iovlen = count;
-		msg.msg_control = cmsg;
-		msg.msg_controllen = clen;
-		msg.msg_flags = 0;
+	op->fd = connection->fd;
+	op->msg.msg_name = NULL;
+	op->msg.msg_namelen = 0;
+	op->msg.msg_iov = op->iov;
+	op->msg.msg_iovlen = count;
+	op->msg.msg_control = op->cmsg;
+	op->msg.msg_controllen = clen;
+	op->msg.msg_flags = 0;
 
-		do {
-			len = sendmsg(connection->fd, &msg, MSG_NOSIGNAL);
-		} while (len < 0 && errno == EINTR);
+	return 1;
+}
 
-		if (len == -1 && errno == EPIPE) {
-			return -1;
-		} else if (len < 0) {
-			fprintf(stderr,
-				"write error for connection %p, fd %d: %m\n",
-				connection, connection->fd);
-			return -1;
-		}
+/* Account for the result of a prepared sendmsg(), with len and errno
+ * as sendmsg() leaves them. */
+int
+wl_connection_sendmsg_done(struct wl_connection *connection, int len)
+{
+	if (len == -1 && errno == EPIPE) {
+		return -1;
+	} else if (len < 0 && errno != EAGAIN) {
+		fprintf(stderr,
+			"write error for connection %p, fd %d: %m\n",
+			connection, connection->fd);
+		return -1;
+	}
 
+	/* EAGAIN just leaves everything queued until the socket
+	 * drains; the caller polls for writable in the meantime. */
+	if (len > 0) {
 		close_fds(&connection->fds_out);
 
 		connection->out.tail += len;
@@ -291,7 +465,51 @@ wl_connection_data(struct wl_connection *connection, uint32_t mask)
 					   connection->data);
 	}
 
+	return 0;
+}
+
+int
+wl_connection_data(struct wl_connection *connection, uint32_t mask)
+{
+	struct wl_connection_sendmsg op;
+	struct iovec iov[2];
+	struct msghdr msg;
+	char cmsg[CLEN];
+	int len, count;
+
+	if ((mask & WL_CONNECTION_WRITABLE) &&
+	    wl_connection_prepare_sendmsg(connection, &op)) {
+		do {
+			len = sendmsg(connection->fd, &op.msg, MSG_NOSIGNAL);
+		} while (len < 0 && errno == EINTR);
+
+		if (wl_connection_sendmsg_done(connection, len) < 0)
+			return -1;
+	}
+
 	if (mask & WL_CONNECTION_READABLE) {
+		/* A full in buffer means the next message is larger
+		 * than the ring; make room for it or give up. */
+		if (connection->in.head - connection->in.tail ==
+		    connection->in.size &&
+		    wl_buffer_grow(&connection->in,
+				   connection->in.size) < 0) {
+			fprintf(stderr, "message too big for connection %p\n",
+				connection);
+			errno = E2BIG;
+			return -1;
+		}
+
+		/* A handler further up the stack may still have its
+		 * arguments in the consumed part of the ring, so read
+		 * into a fresh copy instead of over them. */
+		if (wl_buffer_is_pinned(&connection->in,
+					connection->in.data) &&
+		    wl_buffer_grow(&connection->in, 0) < 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+
 		wl_buffer_put_iov(&connection->in, iov, &count);
 
 		msg.msg_name = NULL;
@@ -306,7 +524,9 @@ wl_connection_data(struct wl_connection *connection, uint32_t mask)
 			len = recvmsg(connection->fd, &msg, MSG_CMSG_CLOEXEC);
 		} while (len < 0 && errno == EINTR);
 
-		if (len < 0) {
+		if (len < 0 && errno == EAGAIN) {
+			len = 0;
+		} else if (len < 0) {
 			fprintf(stderr,
 				"read error from connection %p: %m (%d)\n",
 				connection, errno);
@@ -316,7 +536,8 @@ wl_connection_data(struct wl_connection *connection, uint32_t mask)
 			return -1;
 		}
 
-		decode_cmsg(&connection->fds_in, &msg);
+		if (len > 0)
+			decode_cmsg(&connection->fds_in, &msg);
 
 		connection->in.head += len;
 	}	
@@ -324,13 +545,34 @@ wl_connection_data(struct wl_connection *connection, uint32_t mask)
 	return connection->in.head - connection->in.tail;
 }
 
-void
+static int
+wl_connection_reserve(struct wl_connection *connection, size_t count)
+{
+	if (connection->out.head - connection->out.tail +
+	    count <= connection->out.size)
+		return 0;
+
+	if (wl_buffer_grow(&connection->out, count) == 0)
+		return 0;
+
+	/* Already at the size cap; try to push some of it out. */
+	if (wl_connection_data(connection, WL_CONNECTION_WRITABLE) < 0)
+		return -1;
+
+	if (connection->out.head - connection->out.tail +
+	    count <= connection->out.size)
+		return 0;
+
+	errno = EAGAIN;
+	return -1;
+}
+
+int
 wl_connection_write(struct wl_connection *connection,
 		    const void *data, size_t count)
 {
-	if (connection->out.head - connection->out.tail +
-	    count > ARRAY_LENGTH(connection->out.data))
-		wl_connection_data(connection, WL_CONNECTION_WRITABLE);
+	if (wl_connection_reserve(connection, count) < 0)
+		return -1;
 
 	wl_buffer_put(&connection->out, data, count);
 
@@ -339,6 +581,17 @@ wl_connection_write(struct wl_connection *connection,
 				   WL_CONNECTION_READABLE |
 				   WL_CONNECTION_WRITABLE,
 				   connection->data);
+
+	return 0;
+}
+
+static int
+wl_message_count_args(const struct wl_message *message)
+{
+	if (message->layout)
+		return message->layout->arg_count;
+
+	return strlen(message->signature);
 }
 
 static int
@@ -346,6 +599,9 @@ wl_message_size_extra(const struct wl_message *message)
 {
 	int i, extra;
 
+	if (message->layout)
+		return message->layout->extra_size;
+
 	for (i = 0, extra = 0; message->signature[i]; i++) {
 
 		switch (message->signature[i]) {
@@ -367,11 +623,123 @@ wl_message_size_extra(const struct wl_message *message)
 	return extra;
 }
 
+static size_t
+wl_message_size(const struct wl_message *message, union wl_argument *args)
+{
+	size_t size;
+	int i;
+
+	size = 2 * sizeof (uint32_t);
+	for (i = 0; message->signature[i]; i++) {
+		switch (message->signature[i]) {
+		case 'u':
+		case 'i':
+		case 'o':
+		case 'n':
+			size += sizeof (uint32_t);
+			break;
+		case 's':
+			size += sizeof (uint32_t);
+			if (args[i].s)
+				size += ALIGN(strlen(args[i].s) + 1,
+					      sizeof (uint32_t));
+			break;
+		case 'a':
+			size += sizeof (uint32_t);
+			if (args[i].a)
+				size += ALIGN(args[i].a->size,
+					      sizeof (uint32_t));
+			break;
+		default:
+			break;
+		}
+	}
+
+	return size;
+}
+
+/* The closure buffers double as a per-connection scratch arena: they
+ * only ever grow, so after warming up no message needs an allocation,
+ * however big it is. */
+static int
+wl_closure_reserve(struct wl_closure *closure, size_t size)
+{
+	uint32_t *buffer;
+	size_t alloc;
+
+	if (size <= closure->buffer_size)
+		return 0;
+
+	alloc = closure->buffer_size > 0 ? closure->buffer_size : 256;
+	while (alloc < size)
+		alloc *= 2;
+
+	buffer = malloc(alloc);
+	if (buffer == NULL)
+		return -1;
+
+	free(closure->buffer);
+	closure->buffer = buffer;
+	closure->buffer_size = alloc;
+
+	return 0;
+}
+
+void
+wl_argument_from_va_list(const char *signature, union wl_argument *args,
+			 int count, va_list ap)
+{
+	struct wl_object *object;
+	int i;
+
+	for (i = 0; signature[i] && i < count; i++) {
+		switch (signature[i]) {
+		case 'u':
+			args[i].u = va_arg(ap, uint32_t);
+			break;
+		case 'i':
+			args[i].i = va_arg(ap, int32_t);
+			break;
+		case 's':
+			args[i].s = va_arg(ap, const char *);
+			break;
+		case 'o':
+			args[i].o = va_arg(ap, struct wl_object *);
+			break;
+		case 'n':
+			object = va_arg(ap, struct wl_object *);
+			args[i].n = object->id;
+			break;
+		case 'a':
+			args[i].a = va_arg(ap, struct wl_array *);
+			break;
+		case 'h':
+			args[i].h = va_arg(ap, int);
+			break;
+		}
+	}
+}
+
 struct wl_closure *
 wl_connection_vmarshal(struct wl_connection *connection,
 		       struct wl_object *sender,
 		       uint32_t opcode, va_list ap,
 		       const struct wl_message *message)
+{
+	union wl_argument args[WL_CLOSURE_MAX_ARGS];
+
+	wl_argument_from_va_list(message->signature,
+				 args, ARRAY_LENGTH(args), ap);
+
+	return wl_connection_marshal_array(connection, sender,
+					   opcode, args, message);
+}
+
+struct wl_closure *
+wl_connection_marshal_array(struct wl_connection *connection,
+			    struct wl_object *sender,
+			    uint32_t opcode, union wl_argument *args,
+			    const struct wl_message *message)
 {
 	struct wl_closure *closure = &connection->send_closure;
 	struct wl_object **objectp, *object;
@@ -382,8 +750,31 @@ wl_connection_vmarshal(struct wl_connection *connection,
 	char *extra;
 	int i, count, fd, extra_size, *fd_ptr;
 
+	count = wl_message_count_args(message) + 2;
+	if (count > ARRAY_LENGTH(closure->types)) {
+		printf("too many args (%d)\n", count);
+		errno = EINVAL;
+		return NULL;
+	}
+
 	extra_size = wl_message_size_extra(message);
-	count = strlen(message->signature) + 2;
+	if (message->layout && message->layout->fixed_size)
+		size = message->layout->fixed_size;
+	else
+		size = wl_message_size(message, args);
+
+	if (size > 0xffff) {
+		printf("message too big, message %s(%s)\n",
+		       message->name, message->signature);
+		errno = E2BIG;
+		return NULL;
+	}
+
+	if (wl_closure_reserve(closure, ALIGN(extra_size, sizeof *p) + size) < 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
 	extra = (char *) closure->buffer;
 	start = &closure->buffer[DIV_ROUNDUP(extra_size, sizeof *p)];
 	p = &start[2];
@@ -392,12 +783,12 @@ wl_connection_vmarshal(struct wl_connection *connection,
 		case 'u':
 			closure->types[i] = &ffi_type_uint32;
 			closure->args[i] = p;
-			*p++ = va_arg(ap, uint32_t);
+			*p++ = args[i - 2].u;
 			break;
 		case 'i':
 			closure->types[i] = &ffi_type_sint32;
 			closure->args[i] = p;
-			*p++ = va_arg(ap, int32_t);
+			*p++ = args[i - 2].i;
 			break;
 		case 's':
 			closure->types[i] = &ffi_type_pointer;
@@ -405,7 +796,7 @@ wl_connection_vmarshal(struct wl_connection *connection,
 			sp = (const char **) extra;
 			extra += sizeof *sp;
 
-			s = va_arg(ap, const char *);
+			s = args[i - 2].s;
 			length = s ? strlen(s) + 1: 0;
 			*p++ = length;
 
@@ -423,7 +814,7 @@ wl_connection_vmarshal(struct wl_connection *connection,
 			objectp = (struct wl_object **) extra;
 			extra += sizeof *objectp;
 
-			object = va_arg(ap, struct wl_object *);
+			object = args[i - 2].o;
 			*objectp = object;
 			*p++ = object ? object->id : 0;
 			break;
@@ -431,8 +822,7 @@ wl_connection_vmarshal(struct wl_connection *connection,
 		case 'n':
 			closure->types[i] = &ffi_type_uint32;
 			closure->args[i] = p;
-			object = va_arg(ap, struct wl_object *);
-			*p++ = object->id;
+			*p++ = args[i - 2].n;
 			break;
 
 		case 'a':
@@ -444,7 +834,7 @@ wl_connection_vmarshal(struct wl_connection *connection,
 			*arrayp = (struct wl_array *) extra;
 			extra += sizeof **arrayp;
 
-			array = va_arg(ap, struct wl_array *);
+			array = args[i - 2].a;
 			if (array == NULL || array->size == 0) {
 				*p++ = 0;
 				break;
@@ -465,15 +855,13 @@ wl_connection_vmarshal(struct wl_connection *connection,
 			fd_ptr = (int *) extra;
 			extra += sizeof *fd_ptr;
 
-			fd = va_arg(ap, int);
+			fd = args[i - 2].h;
 			dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
 			if (dup_fd < 0) {
 				fprintf(stderr, "dup failed: %m");
 				abort();
 			}
 			*fd_ptr = dup_fd;
-			wl_buffer_put(&connection->fds_out,
-				      &dup_fd, sizeof dup_fd);
 			break;
 		default:
 			assert(0);
@@ -498,15 +886,15 @@ wl_connection_demarshal(struct wl_connection *connection,
 			struct wl_map *objects,
 			const struct wl_message *message)
 {
-	uint32_t *p, *next, *end, length;
+	uint32_t *p, *next, *end, *start, length, tail;
 	int *fd;
 	char *extra, **s;
-	int i, count, extra_space;
+	int i, count, extra_space, extra_size;
 	struct wl_object **object;
 	struct wl_array **array;
 	struct wl_closure *closure = &connection->receive_closure;
 
-	count = strlen(message->signature) + 2;
+	count = wl_message_count_args(message) + 2;
 	if (count > ARRAY_LENGTH(closure->types)) {
 		printf("too many args (%d)\n", count);
 		errno = EINVAL;
@@ -514,22 +902,58 @@ wl_connection_demarshal(struct wl_connection *connection,
 		return NULL;
 	}
 
+	if (size < 2 * sizeof *p || size & (sizeof *p - 1) ||
+	    (message->layout && message->layout->fixed_size &&
+	     size != message->layout->fixed_size)) {
+		printf("invalid message size (%d), message %s(%s)\n",
+		       size, message->name, message->signature);
+		errno = EINVAL;
+		wl_connection_consume(connection, size);
+		return NULL;
+	}
+
+	/* If the message doesn't wrap around the end of the ring, decode
+	 * it in place and only use the closure buffer for the pointers
+	 * we hand out.  The bytes are consumed right away, so a nested
+	 * dispatch sees the next message, but the ring is pinned until
+	 * the closure is destroyed: growing it doesn't free the
+	 * arguments from under the handler, and reading into it moves
+	 * to a new block first. */
 	extra_space = wl_message_size_extra(message);
-	if (sizeof closure->buffer < size + extra_space) {
-		printf("request too big, should malloc tmp buffer here\n");
+	tail = MASK(&connection->in, connection->in.tail);
+	if (tail + size <= connection->in.size) {
+		start = (uint32_t *) (connection->in.data + tail);
+		extra_size = extra_space;
+	} else {
+		start = NULL;
+		extra_size = size + extra_space;
+	}
+
+	if (wl_closure_reserve(closure, extra_size) < 0 ||
+	    wl_buffer_pin(&connection->in,
+			  start ? connection->in.data : NULL) < 0) {
 		errno = ENOMEM;
 		wl_connection_consume(connection, size);
 		return NULL;
 	}
 
+	closure->pin = &connection->in;
+	closure->pin_depth++;
+
+	if (start == NULL) {
+		wl_connection_copy(connection, closure->buffer, size);
+		start = closure->buffer;
+		extra = (char *) closure->buffer + size;
+	} else {
+		extra = (char *) closure->buffer;
+	}
+
 	closure->message = message;
 	closure->types[0] = &ffi_type_pointer;
 	closure->types[1] = &ffi_type_pointer;
 
-	wl_connection_copy(connection, closure->buffer, size);
-	p = &closure->buffer[2];
-	end = (uint32_t *) ((char *) p + size);
-	extra = (char *) end;
+	p = &start[2];
+	end = (uint32_t *) ((char *) start + size);
 	for (i = 2; i < count; i++) {
 		if (p + 1 > end) {
 			printf("message too short, "
@@ -652,8 +1076,6 @@ wl_connection_demarshal(struct wl_connection *connection,
 	}
 
 	closure->count = i;
-	ffi_prep_cif(&closure->cif, FFI_DEFAULT_ABI,
-		     closure->count, &ffi_type_void, closure->types);
 
 	wl_connection_consume(connection, size);
 
@@ -676,16 +1098,84 @@ wl_closure_invoke(struct wl_closure *closure,
 	closure->args[0] = &data;
 	closure->args[1] = &target;
 
+	/* Scanner generated messages come with a dispatcher that calls
+	 * func with the right prototype; only go through libffi for
+	 * messages that don't have one. */
+	if (closure->message->dispatch) {
+		closure->message->dispatch(func, closure->args);
+		return;
+	}
+
+	ffi_prep_cif(&closure->cif, FFI_DEFAULT_ABI,
+		     closure->count, &ffi_type_void, closure->types);
 	ffi_call(&closure->cif, func, &result, closure->args);
 }
 
-void
+static void
+wl_closure_close_fds(struct wl_closure *closure)
+{
+	int i;
+
+	for (i = 2; i < closure->count; i++)
+		if (closure->message->signature[i - 2] == 'h')
+			close(*(int *) closure->args[i]);
+}
+
+/* The closure's fds are only queued once the message itself is in
+ * the out buffer, so a message we couldn't queue doesn't leave stray
+ * fds behind to be paired with the next one. */
+int
 wl_closure_send(struct wl_closure *closure, struct wl_connection *connection)
 {
 	uint32_t size;
+	int i, nfds;
+
+	nfds = 0;
+	for (i = 2; i < closure->count; i++)
+		if (closure->message->signature[i - 2] == 'h')
+			nfds++;
+
+	/* Make sure all queued fds fit in one sendmsg along with the
+	 * bytes they were queued with. */
+	if (connection->fds_out.head - connection->fds_out.tail +
+	    nfds * sizeof(int32_t) > MAX_FDS_OUT * sizeof(int32_t) &&
+	    (wl_connection_data(connection, WL_CONNECTION_WRITABLE) < 0 ||
+	     connection->fds_out.head != connection->fds_out.tail)) {
+		errno = EAGAIN;
+		wl_closure_close_fds(closure);
+		return -1;
+	}
 
 	size = closure->start[1] >> 16;
-	wl_connection_write(connection, closure->start, size);
+	if (wl_connection_write(connection, closure->start, size) < 0) {
+		wl_closure_close_fds(closure);
+		return -1;
+	}
+
+	for (i = 2; i < closure->count; i++)
+		if (closure->message->signature[i - 2] == 'h')
+			wl_buffer_put(&connection->fds_out,
+				      closure->args[i], sizeof(int32_t));
+
+	return 0;
+}
+
+/* Append the marshalled message, header included, to array.  Any fds
+ * the closure refers to are not copied. */
+int
+wl_closure_copy(struct wl_closure *closure, struct wl_array *array)
+{
+	uint32_t size;
+	void *p;
+
+	size = closure->start[1] >> 16;
+	p = wl_array_add(array, size);
+	if (p == NULL)
+		return -1;
+
+	memcpy(p, closure->start, size);
+
+	return 0;
 }
 
 void
@@ -746,4 +1236,8 @@ wl_closure_print(struct wl_closure *closure, struct wl_object *target, int send)
 void
 wl_closure_destroy(struct wl_closure *closure)
 {
+	if (closure->pin_depth > 0) {
+		wl_buffer_unpin(closure->pin);
+		closure->pin_depth--;
+	}
 }
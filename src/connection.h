@@ -24,8 +24,18 @@
 #define _CONNECTION_H_
 
 #include <stdarg.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include "wayland-util.h"
 
+#define WL_CLOSURE_MAX_ARGS 20
+
+/* The most fds we pass in one sendmsg; the rest go out with the
+ * next one. */
+#define MAX_FDS_OUT	28
+#define CLEN		(CMSG_LEN(MAX_FDS_OUT * sizeof(int32_t)))
+
 struct wl_connection;
 struct wl_closure;
 
@@ -39,10 +49,25 @@ struct wl_connection *wl_connection_create(int fd,
 					   wl_connection_update_func_t update,
 					   void *data);
 void wl_connection_destroy(struct wl_connection *connection);
+void wl_connection_set_max_buffer_size(struct wl_connection *connection,
+				       size_t size);
 void wl_connection_copy(struct wl_connection *connection, void *data, size_t size);
 void wl_connection_consume(struct wl_connection *connection, size_t size);
 int wl_connection_data(struct wl_connection *connection, uint32_t mask);
-void wl_connection_write(struct wl_connection *connection, const void *data, size_t count);
+
+/* Split out of wl_connection_data() so the server can hand the writes
+ * for many connections to the kernel in one go. */
+struct wl_connection_sendmsg {
+	int fd;
+	struct msghdr msg;
+	struct iovec iov[2];
+	char cmsg[CLEN];
+};
+
+int wl_connection_prepare_sendmsg(struct wl_connection *connection,
+				  struct wl_connection_sendmsg *op);
+int wl_connection_sendmsg_done(struct wl_connection *connection, int len);
+int wl_connection_write(struct wl_connection *connection, const void *data, size_t count);
 
 struct wl_closure *
 wl_connection_vmarshal(struct wl_connection *connection,
@@ -50,6 +75,16 @@ wl_connection_vmarshal(struct wl_connection *connection,
 		       uint32_t opcode, va_list ap,
 		       const struct wl_message *message);
 
+void
+wl_argument_from_va_list(const char *signature, union wl_argument *args,
+			 int count, va_list ap);
+
+struct wl_closure *
+wl_connection_marshal_array(struct wl_connection *connection,
+			    struct wl_object *sender,
+			    uint32_t opcode, union wl_argument *args,
+			    const struct wl_message *message);
+
 struct wl_closure *
 wl_connection_demarshal(struct wl_connection *connection,
 			uint32_t size,
@@ -58,8 +93,10 @@ wl_connection_demarshal(struct wl_connection *connection,
 void
 wl_closure_invoke(struct wl_closure *closure,
 		  struct wl_object *target, void (*func)(void), void *data);
-void
+int
 wl_closure_send(struct wl_closure *closure, struct wl_connection *connection);
+int
+wl_closure_copy(struct wl_closure *closure, struct wl_array *array);
 void
 wl_closure_print(struct wl_closure *closure, struct wl_object *target, int send);
 void
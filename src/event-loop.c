@@ -31,15 +31,11 @@
 #include <sys/epoll.h>
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <assert.h>
 #include "wayland-server.h"
-
-struct wl_event_loop {
-	int epoll_fd;
-	struct wl_list check_list;
-	struct wl_list idle_list;
-};
+#include "event-loop.h"
 
 struct wl_event_source_interface {
 	int (*dispatch)(struct wl_event_source *source,
@@ -51,12 +47,145 @@ struct wl_event_source {
 	struct wl_event_source_interface *interface;
 	struct wl_event_loop *loop;
 	struct wl_list link;
+	struct wl_list defer_link;
+	void *data;
+	int fd;
+	int deferred;
+	int removed;
+	int priority;
+	struct wl_event_stats *stats;
+};
+
+#define WL_EVENT_PRIORITY_COUNT (WL_EVENT_PRIORITY_LOW + 1)
+
+struct wl_event_source_timer;
+
+/* All timers of a loop share one timerfd, armed for the earliest
+ * deadline in a binary min-heap of the armed timers. */
+struct wl_timer_heap {
+	struct wl_event_source base;
+	struct wl_event_source_timer **data;
+	int count, space;
+	struct timespec armed;
+};
+
+struct wl_task {
+	struct wl_task *next;
+	wl_event_loop_task_func_t func;
 	void *data;
 };
 
+/* Tasks posted from other threads go on an intrusive multi-producer,
+ * single-consumer queue (Vyukov's): producers swap themselves in at
+ * head, the loop pops from tail.  The eventfd is only written when no
+ * wakeup is already pending. */
+struct wl_task_queue {
+	struct wl_event_source base;
+	struct wl_task *head;
+	struct wl_task *tail;
+	struct wl_task stub;
+	int wakeup_pending;
+};
+
+struct wl_event_loop {
+	int epoll_fd;
+	struct wl_list check_list;
+	struct wl_list defer_list;
+	struct wl_list idle_list;
+	struct wl_list destroy_list;
+	struct wl_timer_heap timers;
+	struct wl_task_queue tasks;
+
+	struct epoll_event *events, *sorted;
+	int events_size;
+	int source_count;
+	int deferred;
+	uint64_t budget;
+
+	struct wl_event_source_slab *slabs;
+	union wl_event_source_block *free_blocks;
+	int live_sources;
+	int destroyed;
+
+	int stats_enabled;
+	struct wl_event_stats stats;
+};
+
+static void *wl_event_loop_alloc_source(struct wl_event_loop *loop);
+static void wl_event_loop_free_source(struct wl_event_loop *loop,
+				      void *source);
+
+static uint64_t
+wl_event_loop_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Log-linear buckets: values below 8ns get a bucket each, above that
+ * every power of two is split into 8 linear sub-buckets, so a bucket
+ * is never more than 12.5% wide. */
+static int
+wl_event_stats_bucket(uint64_t ns)
+{
+	int e, index;
+
+	if (ns < 8)
+		return ns;
+
+	e = 63 - __builtin_clzll(ns);
+	index = (e - 2) * 8 + ((ns >> (e - 3)) & 7);
+
+	return index < WL_EVENT_STATS_BUCKETS ?
+		index : WL_EVENT_STATS_BUCKETS - 1;
+}
+
+WL_EXPORT uint64_t
+wl_event_stats_bucket_floor(int bucket)
+{
+	if (bucket < 8)
+		return bucket;
+
+	return (uint64_t) (8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+static void
+wl_event_stats_add(struct wl_event_stats *stats, uint64_t ns)
+{
+	stats->count++;
+	stats->total_ns += ns;
+	if (ns > stats->max_ns)
+		stats->max_ns = ns;
+	stats->histogram[wl_event_stats_bucket(ns)]++;
+}
+
+/* Per-source stats are only allocated once stats are enabled and the
+ * source is dispatched, so sources cost a NULL pointer otherwise. */
+static struct wl_event_stats *
+wl_event_source_stats(struct wl_event_source *source)
+{
+	if (source->stats == NULL)
+		source->stats = calloc(1, sizeof *source->stats);
+
+	return source->stats;
+}
+
+static void
+wl_event_source_record(struct wl_event_source *source, uint64_t start)
+{
+	struct wl_event_stats *stats;
+
+	stats = wl_event_source_stats(source);
+	if (stats)
+		wl_event_stats_add(stats, wl_event_loop_now() - start);
+}
+
 struct wl_event_source_fd {
 	struct wl_event_source base;
-	int fd;
+	uint32_t mask;
 	wl_event_loop_fd_func_t func;
 };
 
@@ -73,21 +202,17 @@ wl_event_source_fd_dispatch(struct wl_event_source *source,
 	if (ep->events & EPOLLOUT)
 		mask |= WL_EVENT_WRITEABLE;
 
-	return fd_source->func(fd_source->fd, mask, fd_source->base.data);
+	return fd_source->func(source->fd, mask, source->data);
 }
 
 static int
 wl_event_source_fd_remove(struct wl_event_source *source)
 {
-	struct wl_event_source_fd *fd_source =
-		(struct wl_event_source_fd *) source;
 	struct wl_event_loop *loop = source->loop;
-	int fd;
 
-	fd = fd_source->fd;
-	free(source);
+	loop->source_count--;
 
-	return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
 }
 
 struct wl_event_source_interface fd_source_interface = {
@@ -104,14 +229,20 @@ wl_event_loop_add_fd(struct wl_event_loop *loop,
 	struct wl_event_source_fd *source;
 	struct epoll_event ep;
 
-	source = malloc(sizeof *source);
+	source = wl_event_loop_alloc_source(loop);
 	if (source == NULL)
 		return NULL;
 
 	source->base.interface = &fd_source_interface;
 	source->base.loop = loop;
 	wl_list_init(&source->base.link);
-	source->fd = fd;
+	source->base.fd = fd;
+	source->base.deferred = 0;
+	source->base.removed = 0;
+	wl_list_init(&source->base.defer_link);
+	source->base.priority = WL_EVENT_PRIORITY_DEFAULT;
+	source->base.stats = NULL;
+	source->mask = mask;
 	source->func = func;
 	source->base.data = data;
 
@@ -123,10 +254,12 @@ wl_event_loop_add_fd(struct wl_event_loop *loop,
 	ep.data.ptr = source;
 
 	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ep) < 0) {
-		free(source);
+		wl_event_loop_free_source(loop, source);
 		return NULL;
 	}
 
+	loop->source_count++;
+
 	return &source->base;
 }
 
@@ -138,6 +271,11 @@ wl_event_source_fd_update(struct wl_event_source *source, uint32_t mask)
 	struct wl_event_loop *loop = source->loop;
 	struct epoll_event ep;
 
+	/* Callers toggle writable interest as their output queues fill
+	 * and drain; don't bother the kernel if nothing changed. */
+	if (fd_source->mask == mask)
+		return 0;
+
 	memset(&ep, 0, sizeof ep);
 	if (mask & WL_EVENT_READABLE)
 		ep.events |= EPOLLIN;
@@ -145,30 +283,291 @@ wl_event_source_fd_update(struct wl_event_source *source, uint32_t mask)
 		ep.events |= EPOLLOUT;
 	ep.data.ptr = source;
 
-	return epoll_ctl(loop->epoll_fd,
-			 EPOLL_CTL_MOD, fd_source->fd, &ep);
+	if (epoll_ctl(loop->epoll_fd,
+		      EPOLL_CTL_MOD, source->fd, &ep) < 0)
+		return -1;
+
+	fd_source->mask = mask;
+
+	return 0;
 }
 
 struct wl_event_source_timer {
 	struct wl_event_source base;
-	int fd;
+	struct timespec deadline;
+	struct timespec interval;
+	int heap_index;
 	wl_event_loop_timer_func_t func;
 };
 
 static int
-wl_event_source_timer_dispatch(struct wl_event_source *source,
-			       struct epoll_event *ep)
+timespec_compare(const struct timespec *a, const struct timespec *b)
 {
-	struct wl_event_source_timer *timer_source =
-		(struct wl_event_source_timer *) source;
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	if (a->tv_nsec != b->tv_nsec)
+		return a->tv_nsec < b->tv_nsec ? -1 : 1;
+
+	return 0;
+}
+
+static int64_t
+timespec_to_nsec(const struct timespec *ts)
+{
+	return (int64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static void
+timespec_add_nsec(struct timespec *ts, int64_t nsec)
+{
+	nsec += ts->tv_nsec;
+	ts->tv_sec += nsec / 1000000000;
+	ts->tv_nsec = nsec % 1000000000;
+}
+
+static void
+wl_timer_heap_set(struct wl_timer_heap *heap, int i,
+		  struct wl_event_source_timer *timer)
+{
+	heap->data[i] = timer;
+	timer->heap_index = i;
+}
+
+static void
+wl_timer_heap_sift_up(struct wl_timer_heap *heap, int i)
+{
+	struct wl_event_source_timer *timer = heap->data[i];
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (timespec_compare(&heap->data[parent]->deadline,
+				     &timer->deadline) <= 0)
+			break;
+		wl_timer_heap_set(heap, i, heap->data[parent]);
+		i = parent;
+	}
+
+	wl_timer_heap_set(heap, i, timer);
+}
+
+static void
+wl_timer_heap_sift_down(struct wl_timer_heap *heap, int i)
+{
+	struct wl_event_source_timer *timer = heap->data[i];
+	int child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= heap->count)
+			break;
+		if (child + 1 < heap->count &&
+		    timespec_compare(&heap->data[child + 1]->deadline,
+				     &heap->data[child]->deadline) < 0)
+			child++;
+		if (timespec_compare(&timer->deadline,
+				     &heap->data[child]->deadline) <= 0)
+			break;
+		wl_timer_heap_set(heap, i, heap->data[child]);
+		i = child;
+	}
+
+	wl_timer_heap_set(heap, i, timer);
+}
+
+static int
+wl_timer_heap_insert(struct wl_timer_heap *heap,
+		     struct wl_event_source_timer *timer)
+{
+	struct wl_event_source_timer **data;
+	int space;
+
+	if (heap->count == heap->space) {
+		space = heap->space ? heap->space * 2 : 16;
+		data = realloc(heap->data, space * sizeof *data);
+		if (data == NULL)
+			return -1;
+		heap->data = data;
+		heap->space = space;
+	}
+
+	heap->data[heap->count] = timer;
+	wl_timer_heap_sift_up(heap, heap->count++);
+
+	return 0;
+}
+
+static void
+wl_timer_heap_remove(struct wl_timer_heap *heap,
+		     struct wl_event_source_timer *timer)
+{
+	struct wl_event_source_timer *last;
+	int i = timer->heap_index;
+
+	timer->heap_index = -1;
+	last = heap->data[--heap->count];
+	if (i == heap->count)
+		return;
+
+	heap->data[i] = last;
+	last->heap_index = i;
+	if (i > 0 && timespec_compare(&last->deadline,
+				      &heap->data[(i - 1) / 2]->deadline) < 0)
+		wl_timer_heap_sift_up(heap, i);
+	else
+		wl_timer_heap_sift_down(heap, i);
+}
+
+/* Only go to the kernel when the earliest deadline changes. */
+static int
+wl_timer_heap_arm(struct wl_timer_heap *heap)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof its);
+	if (heap->count > 0)
+		its.it_value = heap->data[0]->deadline;
+
+	if (timespec_compare(&its.it_value, &heap->armed) == 0)
+		return 0;
+
+	if (timerfd_settime(heap->base.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		fprintf(stderr, "could not set timerfd\n: %m");
+		return -1;
+	}
+
+	heap->armed = its.it_value;
+
+	return 0;
+}
+
+static int
+wl_timer_heap_dispatch(struct wl_event_source *source,
+		       struct epoll_event *ep)
+{
+	struct wl_timer_heap *heap = (struct wl_timer_heap *) source;
+	struct wl_event_source_timer *timer;
+	struct timespec now;
 	uint64_t expires;
-	int len;
+	int64_t interval, missed;
+	uint64_t start;
+	int len, n, count;
 
-	len = read(timer_source->fd, &expires, sizeof expires);
-	if (len != sizeof expires)
+	len = read(source->fd, &expires, sizeof expires);
+	if (len != sizeof expires && errno != EAGAIN)
 		/* Is there anything we can do here?  Will this ever happen? */
 		fprintf(stderr, "timerfd read error: %m\n");
 
+	/* The timerfd is disarmed once it has fired. */
+	memset(&heap->armed, 0, sizeof heap->armed);
+
+	/* Bound the work to the timers that were armed when we got here,
+	 * in case a callback keeps re-arming itself in the past. */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	count = heap->count;
+	n = 0;
+	while (count-- > 0 && heap->count > 0) {
+		timer = heap->data[0];
+		if (timespec_compare(&timer->deadline, &now) > 0)
+			break;
+
+		wl_timer_heap_remove(heap, timer);
+
+		/* Periodic timers stay on their original grid; if we
+		 * missed some periods, skip ahead rather than firing
+		 * for each of them. */
+		if (timer->interval.tv_sec || timer->interval.tv_nsec) {
+			interval = timespec_to_nsec(&timer->interval);
+			missed = timespec_to_nsec(&now) -
+				timespec_to_nsec(&timer->deadline);
+			timespec_add_nsec(&timer->deadline,
+					  (missed / interval + 1) * interval);
+			wl_timer_heap_insert(heap, timer);
+		}
+
+		start = heap->base.loop->stats_enabled ?
+			wl_event_loop_now() : 0;
+		n += timer->func(timer->base.data);
+		if (start)
+			wl_event_source_record(&timer->base, start);
+	}
+
+	wl_timer_heap_arm(heap);
+
+	return n;
+}
+
+static int
+wl_timer_heap_source_remove(struct wl_event_source *source)
+{
+	return 0;
+}
+
+struct wl_event_source_interface timer_heap_source_interface = {
+	wl_timer_heap_dispatch,
+	wl_timer_heap_source_remove
+};
+
+static int
+wl_timer_heap_ensure_fd(struct wl_event_loop *loop)
+{
+	struct wl_timer_heap *heap = &loop->timers;
+	struct epoll_event ep;
+
+	if (heap->base.fd >= 0)
+		return 0;
+
+	heap->base.fd = timerfd_create(CLOCK_MONOTONIC,
+				       TFD_CLOEXEC | TFD_NONBLOCK);
+	if (heap->base.fd < 0) {
+		fprintf(stderr, "could not create timerfd\n: %m");
+		return -1;
+	}
+
+	memset(&ep, 0, sizeof ep);
+	ep.events = EPOLLIN;
+	ep.data.ptr = &heap->base;
+
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, heap->base.fd, &ep) < 0) {
+		close(heap->base.fd);
+		heap->base.fd = -1;
+		return -1;
+	}
+
+	loop->source_count++;
+
+	return 0;
+}
+
+static void
+wl_timer_heap_init(struct wl_event_loop *loop)
+{
+	struct wl_timer_heap *heap = &loop->timers;
+
+	memset(heap, 0, sizeof *heap);
+	heap->base.interface = &timer_heap_source_interface;
+	heap->base.loop = loop;
+	wl_list_init(&heap->base.link);
+	wl_list_init(&heap->base.defer_link);
+	heap->base.fd = -1;
+	heap->base.priority = WL_EVENT_PRIORITY_TIMER;
+}
+
+static void
+wl_timer_heap_release(struct wl_timer_heap *heap)
+{
+	if (heap->base.fd >= 0)
+		close(heap->base.fd);
+	free(heap->data);
+}
+
+static int
+wl_event_source_timer_dispatch(struct wl_event_source *source,
+			       struct epoll_event *ep)
+{
+	struct wl_event_source_timer *timer_source =
+		(struct wl_event_source_timer *) source;
+
 	return timer_source->func(timer_source->base.data);
 }
 
@@ -178,8 +577,11 @@ wl_event_source_timer_remove(struct wl_event_source *source)
 	struct wl_event_source_timer *timer_source =
 		(struct wl_event_source_timer *) source;
 
-	close(timer_source->fd);
-	free(source);
+	if (timer_source->heap_index >= 0) {
+		wl_timer_heap_remove(&source->loop->timers, timer_source);
+		wl_timer_heap_arm(&source->loop->timers);
+	}
+
 	return 0;
 }
 
@@ -194,61 +596,88 @@ wl_event_loop_add_timer(struct wl_event_loop *loop,
 			void *data)
 {
 	struct wl_event_source_timer *source;
-	struct epoll_event ep;
 
-	source = malloc(sizeof *source);
+	if (wl_timer_heap_ensure_fd(loop) < 0)
+		return NULL;
+
+	source = wl_event_loop_alloc_source(loop);
 	if (source == NULL)
 		return NULL;
 
 	source->base.interface = &timer_source_interface;
 	source->base.loop = loop;
 	wl_list_init(&source->base.link);
+	source->base.fd = -1;
+	source->base.deferred = 0;
+	source->base.removed = 0;
+	wl_list_init(&source->base.defer_link);
+	source->base.priority = WL_EVENT_PRIORITY_DEFAULT;
+	source->base.stats = NULL;
+
+	source->heap_index = -1;
+	memset(&source->interval, 0, sizeof source->interval);
+	source->func = func;
+	source->base.data = data;
 
-	source->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
-	if (source->fd < 0) {
-		fprintf(stderr, "could not create timerfd\n: %m");
-		free(source);
-		return NULL;
+	return &source->base;
+}
+
+WL_EXPORT int
+wl_event_source_timer_settime(struct wl_event_source *source, uint32_t flags,
+			      const struct itimerspec *its)
+{
+	struct wl_event_source_timer *timer_source =
+		(struct wl_event_source_timer *) source;
+	struct wl_timer_heap *heap = &source->loop->timers;
+	struct timespec *deadline = &timer_source->deadline;
+
+	if (its->it_value.tv_sec < 0 ||
+	    its->it_value.tv_nsec < 0 ||
+	    its->it_value.tv_nsec >= 1000000000 ||
+	    its->it_interval.tv_sec < 0 ||
+	    its->it_interval.tv_nsec < 0 ||
+	    its->it_interval.tv_nsec >= 1000000000) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	source->func = func;
-	source->base.data = data;
+	if (timer_source->heap_index >= 0)
+		wl_timer_heap_remove(heap, timer_source);
 
-	memset(&ep, 0, sizeof ep);
-	ep.events = EPOLLIN;
-	ep.data.ptr = source;
+	/* A zero value disarms the timer, as with timerfd_settime(). */
+	if (its->it_value.tv_sec == 0 && its->it_value.tv_nsec == 0)
+		return wl_timer_heap_arm(heap);
 
-	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &ep) < 0) {
-		close(source->fd);
-		free(source);
-		return NULL;
+	if (flags & WL_EVENT_TIMER_ABSTIME) {
+		*deadline = its->it_value;
+	} else {
+		clock_gettime(CLOCK_MONOTONIC, deadline);
+		timespec_add_nsec(deadline, timespec_to_nsec(&its->it_value));
 	}
+	timer_source->interval = its->it_interval;
 
-	return &source->base;
+	if (wl_timer_heap_insert(heap, timer_source) < 0)
+		return -1;
+
+	return wl_timer_heap_arm(heap);
 }
 
 WL_EXPORT int
 wl_event_source_timer_update(struct wl_event_source *source, int ms_delay)
 {
-	struct wl_event_source_timer *timer_source =
-		(struct wl_event_source_timer *) source;
 	struct itimerspec its;
 
-	its.it_interval.tv_sec = 0;
-	its.it_interval.tv_nsec = 0;
-	its.it_value.tv_sec = ms_delay / 1000;
-	its.it_value.tv_nsec = (ms_delay % 1000) * 1000 * 1000;
-	if (timerfd_settime(timer_source->fd, 0, &its, NULL) < 0) {
-		fprintf(stderr, "could not set timerfd\n: %m");
-		return -1;
+	memset(&its, 0, sizeof its);
+	if (ms_delay > 0) {
+		its.it_value.tv_sec = ms_delay / 1000;
+		its.it_value.tv_nsec = (ms_delay % 1000) * 1000 * 1000;
 	}
 
-	return 0;
+	return wl_event_source_timer_settime(source, 0, &its);
 }
 
 struct wl_event_source_signal {
 	struct wl_event_source base;
-	int fd;
 	int signal_number;
 	wl_event_loop_signal_func_t func;
 };
@@ -262,7 +691,7 @@ wl_event_source_signal_dispatch(struct wl_event_source *source,
 	struct signalfd_siginfo signal_info;
 	int len;
 
-	len = read(signal_source->fd, &signal_info, sizeof signal_info);
+	len = read(source->fd, &signal_info, sizeof signal_info);
 	if (len != sizeof signal_info)
 		/* Is there anything we can do here?  Will this ever happen? */
 		fprintf(stderr, "signalfd read error: %m\n");
@@ -274,11 +703,9 @@ wl_event_source_signal_dispatch(struct wl_event_source *source,
 static int
 wl_event_source_signal_remove(struct wl_event_source *source)
 {
-	struct wl_event_source_signal *signal_source =
-		(struct wl_event_source_signal *) source;
+	source->loop->source_count--;
+	close(source->fd);
 
-	close(signal_source->fd);
-	free(source);
 	return 0;
 }
 
@@ -297,21 +724,26 @@ wl_event_loop_add_signal(struct wl_event_loop *loop,
 	struct epoll_event ep;
 	sigset_t mask;
 
-	source = malloc(sizeof *source);
+	source = wl_event_loop_alloc_source(loop);
 	if (source == NULL)
 		return NULL;
 
 	source->base.interface = &signal_source_interface;
 	source->base.loop = loop;
 	wl_list_init(&source->base.link);
+	source->base.deferred = 0;
+	source->base.removed = 0;
+	wl_list_init(&source->base.defer_link);
+	source->base.priority = WL_EVENT_PRIORITY_DEFAULT;
+	source->base.stats = NULL;
 	source->signal_number = signal_number;
 
 	sigemptyset(&mask);
 	sigaddset(&mask, signal_number);
-	source->fd = signalfd(-1, &mask, SFD_CLOEXEC);
-	if (source->fd < 0) {
+	source->base.fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (source->base.fd < 0) {
 		fprintf(stderr, "could not create fd to watch signal\n: %m");
-		free(source);
+		wl_event_loop_free_source(loop, source);
 		return NULL;
 	}
 	sigprocmask(SIG_BLOCK, &mask, NULL);
@@ -323,25 +755,99 @@ wl_event_loop_add_signal(struct wl_event_loop *loop,
 	ep.events = EPOLLIN;
 	ep.data.ptr = source;
 
-	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &ep) < 0) {
-		close(source->fd);
-		free(source);
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->base.fd, &ep) < 0) {
+		close(source->base.fd);
+		wl_event_loop_free_source(loop, source);
 		return NULL;
 	}
 
+	loop->source_count++;
+
 	return &source->base;
 }
 
 struct wl_event_source_idle {
 	struct wl_event_source base;
 	wl_event_loop_idle_func_t func;
+	int persistent;
 };
 
+/* Sources are carved out of per-loop slabs of fixed size blocks, big
+ * enough for any source type, and go back on the loop's free list
+ * when they're destroyed.  The slabs are only released along with
+ * the loop, or after it, once the last source the caller still held
+ * is removed.  next only overlaps base.interface, so free blocks
+ * are told apart by a NULL base.loop. */
+#define WL_EVENT_SOURCE_SLAB_COUNT 32
+
+union wl_event_source_block {
+	union wl_event_source_block *next;
+	struct wl_event_source base;
+	struct wl_event_source_fd fd;
+	struct wl_event_source_timer timer;
+	struct wl_event_source_signal signal;
+	struct wl_event_source_idle idle;
+};
+
+struct wl_event_source_slab {
+	struct wl_event_source_slab *next;
+	union wl_event_source_block blocks[WL_EVENT_SOURCE_SLAB_COUNT];
+};
+
+static void *
+wl_event_loop_alloc_source(struct wl_event_loop *loop)
+{
+	struct wl_event_source_slab *slab;
+	union wl_event_source_block *block;
+	int i;
+
+	if (loop->free_blocks == NULL) {
+		slab = malloc(sizeof *slab);
+		if (slab == NULL)
+			return NULL;
+
+		slab->next = loop->slabs;
+		loop->slabs = slab;
+		for (i = WL_EVENT_SOURCE_SLAB_COUNT - 1; i >= 0; i--) {
+			slab->blocks[i].base.loop = NULL;
+			slab->blocks[i].next = loop->free_blocks;
+			loop->free_blocks = &slab->blocks[i];
+		}
+	}
+
+	block = loop->free_blocks;
+	loop->free_blocks = block->next;
+	loop->live_sources++;
+
+	return block;
+}
+
+static void
+wl_event_loop_free_source(struct wl_event_loop *loop, void *source)
+{
+	union wl_event_source_block *block = source;
+
+	block->base.loop = NULL;
+	block->next = loop->free_blocks;
+	loop->free_blocks = block;
+	loop->live_sources--;
+}
+
+static void
+wl_event_loop_release(struct wl_event_loop *loop)
+{
+	struct wl_event_source_slab *slab, *next;
+
+	for (slab = loop->slabs; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+	free(loop);
+}
+
 static int
 wl_event_source_idle_remove(struct wl_event_source *source)
 {
-	free(source);
-
 	return 0;
 }
 
@@ -357,38 +863,307 @@ wl_event_loop_add_idle(struct wl_event_loop *loop,
 {
 	struct wl_event_source_idle *source;
 
-	source = malloc(sizeof *source);
+	source = wl_event_loop_alloc_source(loop);
 	if (source == NULL)
 		return NULL;
 
 	source->base.interface = &idle_source_interface;
 	source->base.loop = loop;
+	source->base.fd = -1;
+	source->base.deferred = 0;
+	source->base.removed = 0;
+	wl_list_init(&source->base.defer_link);
+	source->base.priority = WL_EVENT_PRIORITY_DEFAULT;
+	source->base.stats = NULL;
 
 	source->func = func;
 	source->base.data = data;
+	source->persistent = 0;
 
 	wl_list_insert(loop->idle_list.prev, &source->base.link);
 
 	return &source->base;
 }
 
+WL_EXPORT struct wl_event_source *
+wl_event_loop_add_persistent_idle(struct wl_event_loop *loop,
+				  wl_event_loop_idle_func_t func,
+				  void *data)
+{
+	struct wl_event_source *source;
+
+	source = wl_event_loop_add_idle(loop, func, data);
+	if (source == NULL)
+		return NULL;
+
+	/* Created disarmed. */
+	wl_list_remove(&source->link);
+	wl_list_init(&source->link);
+	((struct wl_event_source_idle *) source)->persistent = 1;
+
+	return source;
+}
+
+WL_EXPORT int
+wl_event_source_idle_rearm(struct wl_event_source *source)
+{
+	struct wl_event_source_idle *idle =
+		(struct wl_event_source_idle *) source;
+
+	if (source->interface != &idle_source_interface ||
+	    !idle->persistent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (wl_list_empty(&source->link))
+		wl_list_insert(source->loop->idle_list.prev, &source->link);
+
+	return 0;
+}
+
+static void
+wl_task_queue_push(struct wl_task_queue *queue, struct wl_task *task)
+{
+	struct wl_task *prev;
+
+	task->next = NULL;
+	prev = __atomic_exchange_n(&queue->head, task, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, task, __ATOMIC_RELEASE);
+}
+
+/* Consumer side, only called from the loop's thread.  Returns NULL
+ * when the queue is empty, or when a producer is half way through a
+ * push; that producer will wake us up again once it's done. */
+static struct wl_task *
+wl_task_queue_pop(struct wl_task_queue *queue)
+{
+	struct wl_task *tail = queue->tail, *next, *head;
+
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (tail == &queue->stub) {
+		if (next == NULL)
+			return NULL;
+		queue->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		queue->tail = next;
+		return tail;
+	}
+
+	head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	if (tail != head)
+		return NULL;
+
+	wl_task_queue_push(queue, &queue->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		queue->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+static int
+wl_task_queue_dispatch(struct wl_event_source *source,
+		       struct epoll_event *ep)
+{
+	struct wl_task_queue *queue = (struct wl_task_queue *) source;
+	struct wl_task *task;
+	uint64_t count;
+	int n = 0;
+
+	if (read(source->fd, &count, sizeof count) < 0 && errno != EAGAIN)
+		fprintf(stderr, "eventfd read error: %m\n");
+
+	/* Clear the flag before draining, so a task pushed after this
+	 * point either gets popped below or writes the eventfd. */
+	__atomic_store_n(&queue->wakeup_pending, 0, __ATOMIC_SEQ_CST);
+
+	while ((task = wl_task_queue_pop(queue))) {
+		task->func(task->data);
+		free(task);
+		n++;
+	}
+
+	return n > 0;
+}
+
+static int
+wl_task_queue_source_remove(struct wl_event_source *source)
+{
+	return 0;
+}
+
+struct wl_event_source_interface task_queue_source_interface = {
+	wl_task_queue_dispatch,
+	wl_task_queue_source_remove
+};
+
+static int
+wl_task_queue_init(struct wl_event_loop *loop)
+{
+	struct wl_task_queue *queue = &loop->tasks;
+	struct epoll_event ep;
+
+	memset(queue, 0, sizeof *queue);
+	queue->base.interface = &task_queue_source_interface;
+	queue->base.loop = loop;
+	wl_list_init(&queue->base.link);
+	wl_list_init(&queue->base.defer_link);
+	/* Posted tasks are typically input or render completions. */
+	queue->base.priority = WL_EVENT_PRIORITY_HIGH;
+	queue->head = &queue->stub;
+	queue->tail = &queue->stub;
+
+	queue->base.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (queue->base.fd < 0) {
+		fprintf(stderr, "could not create eventfd\n: %m");
+		return -1;
+	}
+
+	memset(&ep, 0, sizeof ep);
+	ep.events = EPOLLIN;
+	ep.data.ptr = &queue->base;
+
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, queue->base.fd, &ep) < 0) {
+		close(queue->base.fd);
+		return -1;
+	}
+
+	loop->source_count++;
+
+	return 0;
+}
+
+static void
+wl_task_queue_release(struct wl_task_queue *queue)
+{
+	struct wl_task *task;
+
+	/* Whatever is still queued is dropped without running. */
+	while ((task = wl_task_queue_pop(queue)))
+		free(task);
+	close(queue->base.fd);
+}
+
+WL_EXPORT int
+wl_event_loop_post_task(struct wl_event_loop *loop,
+			wl_event_loop_task_func_t func, void *data)
+{
+	struct wl_task_queue *queue = &loop->tasks;
+	struct wl_task *task;
+	uint64_t one = 1;
+
+	task = malloc(sizeof *task);
+	if (task == NULL)
+		return -1;
+
+	task->func = func;
+	task->data = data;
+	wl_task_queue_push(queue, task);
+
+	if (__atomic_exchange_n(&queue->wakeup_pending, 1, __ATOMIC_SEQ_CST))
+		return 0;
+
+	if (write(queue->base.fd, &one, sizeof one) < 0 && errno != EAGAIN)
+		return -1;
+
+	return 0;
+}
+
+WL_EXPORT int
+wl_event_source_set_priority(struct wl_event_source *source,
+			     enum wl_event_priority priority)
+{
+	if (priority < WL_EVENT_PRIORITY_HIGH ||
+	    priority > WL_EVENT_PRIORITY_LOW) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Timers fire from the shared timer heap and idle sources run
+	 * once the ready sources are done, so neither has a class of
+	 * its own to change. */
+	if (source->interface == &timer_source_interface ||
+	    source->interface == &idle_source_interface) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	source->priority = priority;
+
+	return 0;
+}
+
 WL_EXPORT void
 wl_event_source_check(struct wl_event_source *source)
 {
+	/* Already on the check list. */
+	if (!wl_list_empty(&source->link))
+		return;
+
 	wl_list_insert(source->loop->check_list.prev, &source->link);
 }
 
+void
+wl_event_source_defer(struct wl_event_source *source)
+{
+	if (!wl_list_empty(&source->defer_link))
+		return;
+
+	wl_list_insert(source->loop->defer_list.prev, &source->defer_link);
+}
+
+/* The source may still have an event pending in the batch being
+ * dispatched, or be deferred, so only free it once the dispatch is
+ * done. */
 WL_EXPORT int
 wl_event_source_remove(struct wl_event_source *source)
 {
+	struct wl_event_loop *loop = source->loop;
+
+	/* wl_event_loop_destroy() already removed it, only the memory
+	 * is left to give back. */
+	if (loop->destroyed) {
+		wl_event_loop_free_source(loop, source);
+		if (loop->live_sources == 0)
+			wl_event_loop_release(loop);
+		return 0;
+	}
+
 	if (!wl_list_empty(&source->link))
 		wl_list_remove(&source->link);
+	if (!wl_list_empty(&source->defer_link)) {
+		wl_list_remove(&source->defer_link);
+		wl_list_init(&source->defer_link);
+	}
 
 	source->interface->remove(source);
+	source->fd = -1;
+	source->removed = 1;
+	wl_list_insert(&loop->destroy_list, &source->link);
 
 	return 0;
 }
 
+static void
+wl_event_loop_process_destroy_list(struct wl_event_loop *loop)
+{
+	struct wl_event_source *source, *next;
+
+	wl_list_for_each_safe(source, next, &loop->destroy_list, link) {
+		free(source->stats);
+		wl_event_loop_free_source(loop, source);
+	}
+
+	wl_list_init(&loop->destroy_list);
+}
+
 WL_EXPORT struct wl_event_loop *
 wl_event_loop_create(void)
 {
@@ -404,7 +1179,29 @@ wl_event_loop_create(void)
 		return NULL;
 	}
 	wl_list_init(&loop->check_list);
+	wl_list_init(&loop->defer_list);
 	wl_list_init(&loop->idle_list);
+	wl_list_init(&loop->destroy_list);
+	wl_timer_heap_init(loop);
+
+	loop->events = NULL;
+	loop->sorted = NULL;
+	loop->events_size = 0;
+	loop->source_count = 0;
+	loop->deferred = 0;
+	loop->budget = 0;
+	loop->slabs = NULL;
+	loop->free_blocks = NULL;
+	loop->live_sources = 0;
+	loop->destroyed = 0;
+	loop->stats_enabled = 0;
+	memset(&loop->stats, 0, sizeof loop->stats);
+
+	if (wl_task_queue_init(loop) < 0) {
+		close(loop->epoll_fd);
+		free(loop);
+		return NULL;
+	}
 
 	return loop;
 }
@@ -412,21 +1209,94 @@ wl_event_loop_create(void)
 WL_EXPORT void
 wl_event_loop_destroy(struct wl_event_loop *loop)
 {
+	struct wl_event_source_slab *slab;
+	struct wl_event_source *source;
+	int i;
+
+	wl_event_loop_process_destroy_list(loop);
+
+	/* Remove whatever sources the caller didn't.  Their blocks stay
+	 * valid until they're passed to wl_event_source_remove(). */
+	for (slab = loop->slabs; slab; slab = slab->next)
+		for (i = 0; i < WL_EVENT_SOURCE_SLAB_COUNT; i++) {
+			source = &slab->blocks[i].base;
+			if (source->loop == NULL)
+				continue;
+			source->interface->remove(source);
+			source->fd = -1;
+			source->removed = 1;
+			free(source->stats);
+			source->stats = NULL;
+		}
+
+	wl_timer_heap_release(&loop->timers);
+	wl_task_queue_release(&loop->tasks);
+	free(loop->timers.base.stats);
+	free(loop->tasks.base.stats);
+	free(loop->events);
 	close(loop->epoll_fd);
-	free(loop);
+
+	if (loop->live_sources == 0)
+		wl_event_loop_release(loop);
+	else
+		loop->destroyed = 1;
 }
 
 static int
 post_dispatch_check(struct wl_event_loop *loop)
 {
 	struct epoll_event ep;
-	struct wl_event_source *source, *next;
+	struct wl_event_source *source;
+	struct wl_list pending;
+	uint64_t start;
 	int n;
 
+	/* Checked sources stay on the check list.  Put each one back
+	 * before dispatching it, so that a handler can remove any of
+	 * them without breaking the walk. */
+	wl_list_init(&pending);
+	wl_list_insert_list(&pending, &loop->check_list);
+	wl_list_init(&loop->check_list);
+
 	ep.events = 0;
 	n = 0;
-	wl_list_for_each_safe(source, next, &loop->check_list, link)
+	while (!wl_list_empty(&pending)) {
+		source = container_of(pending.next,
+				      struct wl_event_source, link);
+		wl_list_remove(&source->link);
+		wl_list_insert(loop->check_list.prev, &source->link);
+
+		start = loop->stats_enabled ? wl_event_loop_now() : 0;
 		n += source->interface->dispatch(source, &ep);
+		if (start)
+			wl_event_source_record(source, start);
+	}
+
+	return n;
+}
+
+static int
+dispatch_deferred_sources(struct wl_event_loop *loop,
+			  struct wl_list *pending)
+{
+	struct epoll_event ep;
+	struct wl_event_source *source;
+	uint64_t start;
+	int n;
+
+	ep.events = 0;
+	n = 0;
+	while (!wl_list_empty(pending)) {
+		source = container_of(pending->next,
+				      struct wl_event_source, defer_link);
+		wl_list_remove(&source->defer_link);
+		wl_list_init(&source->defer_link);
+
+		start = loop->stats_enabled ? wl_event_loop_now() : 0;
+		n += source->interface->dispatch(source, &ep);
+		if (start)
+			wl_event_source_record(source, start);
+	}
 
 	return n;
 }
@@ -434,35 +1304,230 @@ post_dispatch_check(struct wl_event_loop *loop)
 static void
 dispatch_idle_sources(struct wl_event_loop *loop)
 {
-	struct wl_event_source_idle *source, *next;
+	struct wl_event_source_idle *source;
+	struct wl_list pending;
+	uint64_t start;
+
+	/* Only run the idles queued so far.  Ones the callbacks add go
+	 * on idle_list and wait for the next iteration, which then
+	 * doesn't block. */
+	wl_list_init(&pending);
+	wl_list_insert_list(&pending, &loop->idle_list);
+	wl_list_init(&loop->idle_list);
+
+	while (!wl_list_empty(&pending)) {
+		source = container_of(pending.next,
+				      struct wl_event_source_idle, base.link);
+		if (source->persistent) {
+			/* Disarm first, so the callback can rearm it.  The
+			 * rearm puts it on idle_list, not on pending, so it
+			 * runs again on the next iteration, not in this one. */
+			wl_list_remove(&source->base.link);
+			wl_list_init(&source->base.link);
+			start = loop->stats_enabled ? wl_event_loop_now() : 0;
+			source->func(source->base.data);
+			if (start)
+				wl_event_source_record(&source->base, start);
+		} else {
+			source->func(source->base.data);
+			wl_event_source_remove(&source->base);
+		}
+	}
+}
+
+/* Limit how long one dispatch may spend on ready sources, in
+ * nanoseconds; 0 means no limit.  Sources we don't get to are
+ * dispatched first on the next iteration. */
+WL_EXPORT void
+wl_event_loop_set_dispatch_budget(struct wl_event_loop *loop,
+				  uint64_t budget)
+{
+	loop->budget = budget;
+}
+
+WL_EXPORT void
+wl_event_loop_enable_stats(struct wl_event_loop *loop, int enable)
+{
+	loop->stats_enabled = enable;
+}
+
+WL_EXPORT void
+wl_event_loop_get_stats(struct wl_event_loop *loop,
+			struct wl_event_stats *stats)
+{
+	*stats = loop->stats;
+}
+
+WL_EXPORT void
+wl_event_source_get_stats(struct wl_event_source *source,
+			  struct wl_event_stats *stats)
+{
+	if (source->stats)
+		*stats = *source->stats;
+	else
+		memset(stats, 0, sizeof *stats);
+}
+
+WL_EXPORT void
+wl_event_source_add_bytes(struct wl_event_source *source, uint64_t bytes)
+{
+	struct wl_event_loop *loop = source->loop;
+	struct wl_event_stats *stats;
+
+	if (!loop->stats_enabled)
+		return;
+
+	stats = wl_event_source_stats(source);
+	if (stats)
+		stats->bytes += bytes;
+	loop->stats.bytes += bytes;
+}
+
+/* Size the batch to the number of sources we're watching, so a single
+ * epoll_wait() can return every ready one. */
+static void
+wl_event_loop_reserve_events(struct wl_event_loop *loop)
+{
+	struct epoll_event *events;
+	int size;
+
+	size = loop->events_size ? loop->events_size : 32;
+	while (size < loop->source_count)
+		size *= 2;
+
+	if (size == loop->events_size)
+		return;
+
+	/* The second half is scratch space for sorting the batch. */
+	events = realloc(loop->events, 2 * size * sizeof *events);
+	if (events == NULL)
+		return;
 
-	wl_list_for_each_safe(source, next, &loop->idle_list, base.link) {
-		source->func(source->base.data);
-		wl_event_source_remove(&source->base);
+	loop->events = events;
+	loop->sorted = events + size;
+	loop->events_size = size;
+}
+
+static int
+event_key(struct epoll_event *ep)
+{
+	struct wl_event_source *source = ep->data.ptr;
+
+	return source->priority * 2 + !source->deferred;
+}
+
+/* Order the batch by priority class, and within each class put the
+ * sources that were cut off by the budget last time first.  This is a
+ * counting sort, so otherwise epoll's order is kept. */
+static struct epoll_event *
+wl_event_loop_sort_events(struct wl_event_loop *loop, int count)
+{
+	int start[WL_EVENT_PRIORITY_COUNT * 2 + 1];
+	int i, key, mixed;
+
+	memset(start, 0, sizeof start);
+	mixed = 0;
+	for (i = 0; i < count; i++) {
+		key = event_key(&loop->events[i]);
+		if (key != event_key(&loop->events[0]))
+			mixed = 1;
+		start[key + 1]++;
 	}
+
+	if (!mixed)
+		return loop->events;
+
+	for (i = 1; i < WL_EVENT_PRIORITY_COUNT * 2; i++)
+		start[i] += start[i - 1];
+
+	for (i = 0; i < count; i++) {
+		key = event_key(&loop->events[i]);
+		loop->sorted[start[key]++] = loop->events[i];
+	}
+
+	return loop->sorted;
 }
 
 WL_EXPORT int
 wl_event_loop_dispatch(struct wl_event_loop *loop, int timeout)
 {
-	struct epoll_event ep[32];
+	struct epoll_event *ep;
 	struct wl_event_source *source;
+	struct wl_list pending;
+	uint64_t start, idle, t;
 	int i, count, n;
 
+	idle = loop->stats_enabled ? wl_event_loop_now() : 0;
 	dispatch_idle_sources(loop);
-
-	count = epoll_wait(loop->epoll_fd, ep, ARRAY_LENGTH(ep), timeout);
-	if (count < 0)
+	if (idle)
+		idle = wl_event_loop_now() - idle;
+
+	/* Sources deferred so far get their turn after this iteration's
+	 * events, so they can't run twice in a row ahead of the other
+	 * sources.  Ones deferred from here on wait for the next
+	 * iteration. */
+	wl_list_init(&pending);
+	wl_list_insert_list(&pending, &loop->defer_list);
+	wl_list_init(&loop->defer_list);
+
+	wl_event_loop_reserve_events(loop);
+	if (loop->deferred || !wl_list_empty(&pending) ||
+	    !wl_list_empty(&loop->idle_list))
+		timeout = 0;
+
+	count = epoll_wait(loop->epoll_fd,
+			   loop->events, loop->events_size, timeout);
+	if (count < 0) {
+		wl_list_insert_list(&loop->defer_list, &pending);
 		return -1;
+	}
+
+	ep = wl_event_loop_sort_events(loop, count);
+	loop->deferred = 0;
+
+	start = loop->budget || loop->stats_enabled ? wl_event_loop_now() : 0;
 	n = 0;
 	for (i = 0; i < count; i++) {
 		source = ep[i].data.ptr;
+		if (source->removed)
+			continue;
+
+		if (loop->budget && i > 0 &&
+		    wl_event_loop_now() - start > loop->budget)
+			break;
+
+		/* Being dispatched now stands in for its deferred turn. */
+		if (!wl_list_empty(&source->defer_link)) {
+			wl_list_remove(&source->defer_link);
+			wl_list_init(&source->defer_link);
+		}
+
+		source->deferred = 0;
+		t = loop->stats_enabled ? wl_event_loop_now() : 0;
 		n += source->interface->dispatch(source, &ep[i]);
+		if (t)
+			wl_event_source_record(source, t);
 	}
 
+	for (; i < count; i++) {
+		source = ep[i].data.ptr;
+		if (source->removed)
+			continue;
+		source->deferred = 1;
+		loop->deferred = 1;
+	}
+
+	n += dispatch_deferred_sources(loop, &pending);
+
 	while (n > 0)
 		n = post_dispatch_check(loop);
-		
+
+	if (loop->stats_enabled)
+		wl_event_stats_add(&loop->stats,
+				   idle + wl_event_loop_now() - start);
+
+	wl_event_loop_process_destroy_list(loop);
+
 	return 0;
 }
 
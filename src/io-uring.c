@@ -0,0 +1,300 @@
+/*
+ * Copyright © 2008 Kristian Høgsberg
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "io-uring.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+
+struct wl_io_uring {
+	int fd;
+	unsigned int queued;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/* Kernels before 5.6 can't be probed.  Those that have io_uring but
+ * no IORING_OP_SENDMSG fail each op with -EINVAL, which the caller
+ * handles by falling back to sendmsg(). */
+static int
+wl_io_uring_probe_sendmsg(int fd)
+{
+#ifdef IO_URING_OP_SUPPORTED
+	struct io_uring_probe *probe;
+	int ret;
+
+	probe = calloc(1, sizeof *probe + 256 * sizeof probe->ops[0]);
+	if (probe == NULL)
+		return 0;
+
+	ret = syscall(__NR_io_uring_register, fd,
+		      IORING_REGISTER_PROBE, probe, 256);
+	if (ret < 0)
+		ret = errno == EINVAL;
+	else
+		ret = probe->last_op >= IORING_OP_SENDMSG &&
+			(probe->ops[IORING_OP_SENDMSG].flags &
+			 IO_URING_OP_SUPPORTED);
+	free(probe);
+
+	return ret;
+#else
+	return 1;
+#endif
+}
+
+struct wl_io_uring *
+wl_io_uring_create(unsigned int entries)
+{
+	struct wl_io_uring *ring;
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	ring = malloc(sizeof *ring);
+	if (ring == NULL)
+		return NULL;
+
+	memset(ring, 0, sizeof *ring);
+	memset(&p, 0, sizeof p);
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+
+	if (!wl_io_uring_probe_sendmsg(ring->fd)) {
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size =
+		p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size,
+			     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			     ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+			     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			     ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size,
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+	    ring->sqes == MAP_FAILED) {
+		wl_io_uring_destroy(ring);
+		return NULL;
+	}
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned int *) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	ring->sq_entries = (unsigned int *) (sq + p.sq_off.ring_entries);
+	ring->sq_array = (unsigned int *) (sq + p.sq_off.array);
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned int *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	return ring;
+}
+
+void
+wl_io_uring_destroy(struct wl_io_uring *ring)
+{
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	close(ring->fd);
+	free(ring);
+}
+
+int
+wl_io_uring_queue_sendmsg(struct wl_io_uring *ring, int fd,
+			  struct msghdr *msg, int flags, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head, tail, index;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	tail = *ring->sq_tail;
+	if (tail - head == *ring->sq_entries) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) msg;
+	sqe->len = 1;
+	sqe->msg_flags = flags;
+	sqe->user_data = user_data;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+
+	return 0;
+}
+
+static unsigned int
+wl_io_uring_ready(struct wl_io_uring *ring)
+{
+	return __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) -
+		*ring->cq_head;
+}
+
+/* Submit everything queued and wait until all of it has completed,
+ * normally with one io_uring_enter().  *accepted is set to how many
+ * entries, in the order they were queued, the kernel took; the rest
+ * are dropped again and never run.  Returns -1 if not everything was
+ * taken or if waiting failed, in which case some accepted entries may
+ * have no completion yet.  Expects the completion queue to have been
+ * reaped empty. */
+int
+wl_io_uring_submit_and_wait(struct wl_io_uring *ring, unsigned int *accepted)
+{
+	unsigned int submitted = 0;
+	int ret, failed = 0;
+
+	/* The kernel only waits if it took every entry, so a second
+	 * call is only needed after a short submission. */
+	while (ring->queued > 0) {
+		ret = syscall(__NR_io_uring_enter, ring->fd,
+			      ring->queued, submitted + ring->queued,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		submitted += ret;
+		ring->queued -= ret;
+	}
+
+	if (ring->queued > 0) {
+		__atomic_store_n(ring->sq_tail,
+				 __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE),
+				 __ATOMIC_RELEASE);
+		ring->queued = 0;
+		failed = 1;
+	}
+
+	*accepted = submitted;
+
+	/* A signal may have cut the wait short, or the submission was
+	 * short and never waited at all. */
+	while (wl_io_uring_ready(ring) < submitted) {
+		ret = syscall(__NR_io_uring_enter, ring->fd,
+			      0, submitted, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR)
+			return -1;
+	}
+
+	return failed ? -1 : 0;
+}
+
+int
+wl_io_uring_reap(struct wl_io_uring *ring, uint64_t *user_data, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+
+	head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+#else
+
+struct wl_io_uring *
+wl_io_uring_create(unsigned int entries)
+{
+	return NULL;
+}
+
+void
+wl_io_uring_destroy(struct wl_io_uring *ring)
+{
+}
+
+int
+wl_io_uring_queue_sendmsg(struct wl_io_uring *ring, int fd,
+			  struct msghdr *msg, int flags, uint64_t user_data)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+wl_io_uring_submit_and_wait(struct wl_io_uring *ring, unsigned int *accepted)
+{
+	*accepted = 0;
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+wl_io_uring_reap(struct wl_io_uring *ring, uint64_t *user_data, int *res)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright © 2008 Kristian Høgsberg
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#ifndef _IO_URING_H_
+#define _IO_URING_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+struct wl_io_uring;
+
+/* A minimal io_uring, used to submit a batch of sendmsg()s with one
+ * syscall.  wl_io_uring_create() returns NULL if the kernel (or the
+ * headers we were built against) don't support io_uring or its
+ * sendmsg op; callers fall back to plain sendmsg(). */
+struct wl_io_uring *wl_io_uring_create(unsigned int entries);
+void wl_io_uring_destroy(struct wl_io_uring *ring);
+int wl_io_uring_queue_sendmsg(struct wl_io_uring *ring, int fd,
+			      struct msghdr *msg, int flags,
+			      uint64_t user_data);
+int wl_io_uring_submit_and_wait(struct wl_io_uring *ring,
+				unsigned int *accepted);
+int wl_io_uring_reap(struct wl_io_uring *ring,
+		     uint64_t *user_data, int *res);
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * Copyright © 2008 Kristian Høgsberg
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+/* Synthetic client spawned by load-server.  It binds the compositor
+ * and shm, creates a surface and loops attach/damage/frame, timing
+ * each frame from the request until the callback arrives.  The
+ * latency samples, in microseconds, are written to the fd given on
+ * the command line when we're done. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "wayland-client.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+
+struct load {
+	struct wl_display *display;
+	struct wl_compositor *compositor;
+	struct wl_shm *shm;
+	struct wl_surface *surface;
+	struct wl_buffer *buffer;
+	int done;
+};
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void
+handle_global(struct wl_display *display, uint32_t id,
+	      const char *interface, uint32_t version, void *data)
+{
+	struct load *load = data;
+
+	if (strcmp(interface, "wl_compositor") == 0)
+		load->compositor =
+			wl_display_bind(display, id, &wl_compositor_interface);
+	else if (strcmp(interface, "wl_shm") == 0)
+		load->shm = wl_display_bind(display, id, &wl_shm_interface);
+}
+
+static void
+frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct load *load = data;
+
+	load->done = 1;
+	wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener frame_listener = {
+	frame_done
+};
+
+static struct wl_buffer *
+create_buffer(struct load *load)
+{
+	struct wl_buffer *buffer;
+	char filename[] = "/tmp/wayland-load-XXXXXX";
+	int fd, stride;
+
+	fd = mkstemp(filename);
+	if (fd < 0) {
+		fprintf(stderr, "failed to create buffer file: %m\n");
+		return NULL;
+	}
+
+	unlink(filename);
+	stride = WIDTH * 4;
+	if (ftruncate(fd, stride * HEIGHT) < 0) {
+		fprintf(stderr, "failed to size buffer file: %m\n");
+		close(fd);
+		return NULL;
+	}
+
+	buffer = wl_shm_create_buffer(load->shm, fd, WIDTH, HEIGHT,
+				      stride, WL_SHM_FORMAT_XRGB32);
+	close(fd);
+
+	return buffer;
+}
+
+static int
+write_samples(int fd, uint32_t *samples, int count)
+{
+	const char *p = (const char *) samples;
+	size_t size = count * sizeof *samples;
+	ssize_t len;
+
+	while (size > 0) {
+		len = write(fd, p, size);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			return -1;
+		p += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct load load;
+	struct wl_callback *callback;
+	struct timespec next;
+	uint32_t *samples;
+	uint64_t start, interval_ns;
+	int i, frames, rate, result_fd;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s result-fd frames rate\n", argv[0]);
+		return 1;
+	}
+
+	result_fd = strtol(argv[1], NULL, 0);
+	frames = strtol(argv[2], NULL, 0);
+	rate = strtol(argv[3], NULL, 0);
+
+	samples = malloc(frames * sizeof *samples);
+	if (samples == NULL)
+		return 1;
+
+	memset(&load, 0, sizeof load);
+	load.display = wl_display_connect(NULL);
+	if (load.display == NULL) {
+		fprintf(stderr, "failed to connect: %m\n");
+		return 1;
+	}
+
+	wl_display_add_global_listener(load.display, handle_global, &load);
+	wl_display_roundtrip(load.display);
+	if (load.compositor == NULL || load.shm == NULL) {
+		fprintf(stderr, "compositor or shm global missing\n");
+		return 1;
+	}
+
+	load.surface = wl_compositor_create_surface(load.compositor);
+	load.buffer = create_buffer(&load);
+	if (load.buffer == NULL)
+		return 1;
+
+	interval_ns = rate > 0 ? 1000000000ull / rate : 0;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (i = 0; i < frames; i++) {
+		start = now_us();
+		wl_surface_attach(load.surface, load.buffer, 0, 0);
+		wl_surface_damage(load.surface, 0, 0, WIDTH, HEIGHT);
+		callback = wl_surface_frame(load.surface);
+		wl_callback_add_listener(callback, &frame_listener, &load);
+		wl_display_flush(load.display);
+
+		load.done = 0;
+		while (!load.done)
+			wl_display_iterate(load.display, WL_DISPLAY_READABLE);
+		samples[i] = now_us() - start;
+
+		if (interval_ns == 0)
+			continue;
+
+		next.tv_nsec += interval_ns;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	if (write_samples(result_fd, samples, frames) < 0) {
+		fprintf(stderr, "failed to write samples: %m\n");
+		return 1;
+	}
+
+	close(result_fd);
+	free(samples);
+	wl_buffer_destroy(load.buffer);
+	wl_surface_destroy(load.surface);
+	wl_display_destroy(load.display);
+
+	return 0;
+}
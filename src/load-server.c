@@ -0,0 +1,555 @@
+/*
+ * Copyright © 2008 Kristian Høgsberg
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+/* Headless compositor for load testing the server core.  It forks N
+ * load-client processes, each of which loops attach/damage/frame on a
+ * surface, and answers their frame callbacks as soon as it has
+ * dispatched the requests.  The clients send back their frame latency
+ * samples over a pipe, and once they are all done we print
+ * throughput, latency percentiles and server CPU time as JSON. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "wayland-server.h"
+
+struct load_client {
+	struct load_server *server;
+	pid_t pid;
+	int result_fd;
+	struct wl_event_source *result_source;
+	struct wl_array samples;
+	int status;
+};
+
+struct load_server {
+	struct wl_display *display;
+	struct wl_list frame_list;
+	struct wl_event_source *repaint_source;
+	struct load_client *clients;
+	int client_count;
+	int running;
+	uint32_t frames;
+};
+
+struct load_surface {
+	struct wl_surface surface;
+	struct load_server *server;
+};
+
+struct frame_callback {
+	struct wl_resource resource;
+	struct wl_list link;
+};
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void
+repaint(void *data)
+{
+	struct load_server *server = data;
+	struct frame_callback *cb, *next;
+	uint32_t msecs;
+
+	server->repaint_source = NULL;
+	msecs = now_us() / 1000;
+
+	wl_list_for_each_safe(cb, next, &server->frame_list, link) {
+		wl_resource_post_event(&cb->resource,
+				       WL_CALLBACK_DONE, msecs);
+		wl_resource_destroy(&cb->resource, 0);
+		server->frames++;
+	}
+}
+
+static void
+destroy_frame_callback(struct wl_resource *resource)
+{
+	struct frame_callback *cb = resource->data;
+
+	wl_list_remove(&cb->link);
+	free(cb);
+}
+
+static void
+surface_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource, 0);
+}
+
+static void
+surface_attach(struct wl_client *client, struct wl_resource *resource,
+	       struct wl_resource *buffer, int32_t x, int32_t y)
+{
+}
+
+static void
+surface_damage(struct wl_client *client, struct wl_resource *resource,
+	       int32_t x, int32_t y, int32_t width, int32_t height)
+{
+}
+
+static void
+surface_frame(struct wl_client *client,
+	      struct wl_resource *resource, uint32_t callback)
+{
+	struct load_surface *surface = resource->data;
+	struct load_server *server = surface->server;
+	struct wl_event_loop *loop;
+	struct frame_callback *cb;
+
+	cb = malloc(sizeof *cb);
+	if (cb == NULL) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	memset(cb, 0, sizeof *cb);
+	cb->resource.object.interface = &wl_callback_interface;
+	cb->resource.object.id = callback;
+	cb->resource.destroy = destroy_frame_callback;
+	cb->resource.data = cb;
+	wl_client_add_resource(client, &cb->resource);
+	wl_list_insert(server->frame_list.prev, &cb->link);
+
+	/* Answer frame callbacks as soon as we've caught up, so the
+	 * measured latency is that of the server core. */
+	if (server->repaint_source == NULL) {
+		loop = wl_display_get_event_loop(server->display);
+		server->repaint_source =
+			wl_event_loop_add_idle(loop, repaint, server);
+	}
+}
+
+static const struct wl_surface_interface surface_interface = {
+	surface_destroy,
+	surface_attach,
+	surface_damage,
+	surface_frame
+};
+
+static void
+destroy_surface(struct wl_resource *resource)
+{
+	struct load_surface *surface = resource->data;
+
+	free(surface);
+}
+
+static void
+compositor_create_surface(struct wl_client *client,
+			  struct wl_resource *resource, uint32_t id)
+{
+	struct load_server *server = resource->data;
+	struct load_surface *surface;
+
+	surface = malloc(sizeof *surface);
+	if (surface == NULL) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	memset(surface, 0, sizeof *surface);
+	surface->server = server;
+	surface->surface.resource.object.interface = &wl_surface_interface;
+	surface->surface.resource.object.implementation =
+		(void (**)(void)) &surface_interface;
+	surface->surface.resource.object.id = id;
+	surface->surface.resource.destroy = destroy_surface;
+	surface->surface.resource.data = surface;
+	wl_client_add_resource(client, &surface->surface.resource);
+}
+
+static const struct wl_compositor_interface compositor_interface = {
+	compositor_create_surface
+};
+
+static void
+bind_compositor(struct wl_client *client,
+		void *data, uint32_t version, uint32_t id)
+{
+	wl_client_add_object(client, &wl_compositor_interface,
+			     &compositor_interface, id, data);
+}
+
+static void
+buffer_created(struct wl_buffer *buffer)
+{
+}
+
+static void
+buffer_damaged(struct wl_buffer *buffer,
+	       int32_t x, int32_t y, int32_t width, int32_t height)
+{
+}
+
+static void
+buffer_destroyed(struct wl_buffer *buffer)
+{
+}
+
+static const struct wl_shm_callbacks shm_callbacks = {
+	buffer_created,
+	buffer_damaged,
+	buffer_destroyed
+};
+
+static int
+result_data(int fd, uint32_t mask, void *data)
+{
+	struct load_client *client = data;
+	char buffer[4096], *p;
+	int len;
+
+	len = read(fd, buffer, sizeof buffer);
+	if (len < 0 && errno == EAGAIN)
+		return 1;
+
+	if (len <= 0) {
+		wl_event_source_remove(client->result_source);
+		client->result_source = NULL;
+		close(client->result_fd);
+		return 1;
+	}
+
+	p = wl_array_add(&client->samples, len);
+	memcpy(p, buffer, len);
+
+	return 1;
+}
+
+static int
+handle_sigchld(int signal_number, void *data)
+{
+	struct load_server *server = data;
+	int i, status;
+	pid_t pid;
+
+	while (pid = waitpid(-1, &status, WNOHANG), pid > 0) {
+		for (i = 0; i < server->client_count; i++)
+			if (server->clients[i].pid == pid) {
+				server->clients[i].pid = 0;
+				server->clients[i].status = status;
+				server->running--;
+			}
+	}
+
+	if (server->running == 0)
+		wl_display_terminate(server->display);
+
+	return 1;
+}
+
+static int
+spawn_client(struct load_server *server, struct load_client *client,
+	     const char *path, const char *frames, const char *rate)
+{
+	struct wl_event_loop *loop;
+	int sv[2], result[2], flags;
+	char socket_str[16], result_str[16];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+		return -1;
+
+	if (pipe2(result, O_CLOEXEC) < 0) {
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	client->server = server;
+	wl_array_init(&client->samples);
+
+	client->pid = fork();
+	if (client->pid == -1) {
+		close(sv[0]);
+		close(sv[1]);
+		close(result[0]);
+		close(result[1]);
+		return -1;
+	}
+
+	if (client->pid == 0) {
+		/* Clear CLOEXEC on the fds the client needs. */
+		flags = fcntl(sv[1], F_GETFD);
+		fcntl(sv[1], F_SETFD, flags & ~FD_CLOEXEC);
+		flags = fcntl(result[1], F_GETFD);
+		fcntl(result[1], F_SETFD, flags & ~FD_CLOEXEC);
+
+		snprintf(socket_str, sizeof socket_str, "%d", sv[1]);
+		snprintf(result_str, sizeof result_str, "%d", result[1]);
+		setenv("WAYLAND_SOCKET", socket_str, 1);
+
+		execl(path, path, result_str, frames, rate, NULL);
+		fprintf(stderr, "failed to exec %s: %m\n", path);
+		_exit(1);
+	}
+
+	close(sv[1]);
+	close(result[1]);
+
+	if (wl_client_create(server->display, sv[0]) == NULL) {
+		close(sv[0]);
+		close(result[0]);
+		return -1;
+	}
+
+	loop = wl_display_get_event_loop(server->display);
+	client->result_fd = result[0];
+	client->result_source =
+		wl_event_loop_add_fd(loop, result[0], WL_EVENT_READABLE,
+				     result_data, client);
+	server->running++;
+
+	return 0;
+}
+
+static int
+compare_samples(const void *a, const void *b)
+{
+	const uint32_t *sa = a, *sb = b;
+
+	return (*sa > *sb) - (*sa < *sb);
+}
+
+static double
+timeval_to_sec(struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static double
+stats_percentile_us(struct wl_event_stats *stats, double p)
+{
+	uint64_t target, seen = 0;
+	int i;
+
+	target = stats->count * p;
+	for (i = 0; i < WL_EVENT_STATS_BUCKETS; i++) {
+		seen += stats->histogram[i];
+		if (seen > target)
+			return wl_event_stats_bucket_floor(i) / 1000.0;
+	}
+
+	return stats->max_ns / 1000.0;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-n clients] [-f frames] [-r rate] [-b budget] "
+		"[-s] [-c client]\n"
+		"  -n  number of clients to spawn (default 16)\n"
+		"  -f  frames per client (default 1000)\n"
+		"  -r  frames per second per client, 0 for as fast as "
+		"possible (default 0)\n"
+		"  -b  requests per client per wakeup, 0 for unlimited "
+		"(default 0)\n"
+		"  -s  collect event loop dispatch statistics\n"
+		"  -c  path to the load-client binary "
+		"(default ./load-client)\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct load_server server;
+	struct wl_event_loop *loop;
+	struct rusage usage_self;
+	struct wl_array all;
+	const char *client_path = "./load-client";
+	char frames_str[16], rate_str[16];
+	uint32_t *samples, *p;
+	uint64_t start, end;
+	double elapsed, cpu;
+	struct wl_event_stats stats;
+	int i, opt, count, frames, rate, budget, collect_stats, failed;
+
+	server.client_count = 16;
+	frames = 1000;
+	rate = 0;
+	budget = 0;
+	collect_stats = 0;
+	while ((opt = getopt(argc, argv, "n:f:r:b:sc:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			server.client_count = strtol(optarg, NULL, 0);
+			break;
+		case 'f':
+			frames = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			rate = strtol(optarg, NULL, 0);
+			break;
+		case 'b':
+			budget = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			collect_stats = 1;
+			break;
+		case 'c':
+			client_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (server.client_count <= 0 || frames <= 0 || rate < 0 || budget < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	snprintf(frames_str, sizeof frames_str, "%d", frames);
+	snprintf(rate_str, sizeof rate_str, "%d", rate);
+
+	server.display = wl_display_create();
+	if (server.display == NULL) {
+		fprintf(stderr, "failed to create display\n");
+		return 1;
+	}
+
+	wl_display_set_request_budget(server.display, budget);
+	wl_list_init(&server.frame_list);
+	server.repaint_source = NULL;
+	server.running = 0;
+	server.frames = 0;
+
+	wl_display_add_global(server.display, &wl_compositor_interface,
+			      &server, bind_compositor);
+	wl_shm_init(server.display, &shm_callbacks);
+
+	/* Block SIGCHLD before forking so an early exit isn't lost. */
+	loop = wl_display_get_event_loop(server.display);
+	wl_event_loop_add_signal(loop, SIGCHLD, handle_sigchld, &server);
+	wl_event_loop_enable_stats(loop, collect_stats);
+
+	server.clients = calloc(server.client_count, sizeof *server.clients);
+	if (server.clients == NULL)
+		return 1;
+
+	start = now_us();
+	for (i = 0; i < server.client_count; i++)
+		if (spawn_client(&server, &server.clients[i],
+				 client_path, frames_str, rate_str) < 0) {
+			fprintf(stderr, "failed to spawn client: %m\n");
+			return 1;
+		}
+
+	wl_display_run(server.display);
+	end = now_us();
+
+	/* Pick up whatever the clients wrote before exiting. */
+	for (i = 0; i < server.client_count; i++)
+		while (server.clients[i].result_source)
+			result_data(server.clients[i].result_fd,
+				    WL_EVENT_READABLE, &server.clients[i]);
+
+	getrusage(RUSAGE_SELF, &usage_self);
+	wl_event_loop_get_stats(loop, &stats);
+
+	wl_array_init(&all);
+	failed = 0;
+	for (i = 0; i < server.client_count; i++) {
+		if (!WIFEXITED(server.clients[i].status) ||
+		    WEXITSTATUS(server.clients[i].status) != 0)
+			failed++;
+		p = wl_array_add(&all, server.clients[i].samples.size);
+		memcpy(p, server.clients[i].samples.data,
+		       server.clients[i].samples.size);
+		wl_array_release(&server.clients[i].samples);
+	}
+
+	samples = all.data;
+	count = all.size / sizeof *samples;
+	qsort(samples, count, sizeof *samples, compare_samples);
+
+	elapsed = (end - start) / 1e6;
+	cpu = timeval_to_sec(&usage_self.ru_utime) +
+		timeval_to_sec(&usage_self.ru_stime);
+
+	printf("{\n"
+	       "  \"clients\": %d,\n"
+	       "  \"failed_clients\": %d,\n"
+	       "  \"frames_per_client\": %d,\n"
+	       "  \"rate\": %d,\n"
+	       "  \"request_budget\": %d,\n"
+	       "  \"frames\": %u,\n"
+	       "  \"elapsed_sec\": %.3f,\n"
+	       "  \"frames_per_sec\": %.0f,\n"
+	       "  \"latency_us\": { \"samples\": %d, "
+	       "\"p50\": %u, \"p99\": %u, \"max\": %u },\n"
+	       "  \"server_cpu_sec\": %.3f,\n"
+	       "  \"server_cpu_per_client_sec\": %.4f,\n"
+	       "  \"server_cpu_per_frame_us\": %.2f",
+
+	       server.client_count, failed, frames, rate, budget,
+	       server.frames,
+	       elapsed, server.frames / elapsed,
+	       count,
+	       count ? samples[count / 2] : 0,
+	       count ? samples[(int) (count * 0.99)] : 0,
+	       count ? samples[count - 1] : 0,
+	       cpu, cpu / server.client_count,
+	       server.frames ? cpu * 1e6 / server.frames : 0.0);
+
+	if (collect_stats)
+		printf(",\n"
+		       "  \"loop_iterations\": %llu,\n"
+		       "  \"loop_bytes\": %llu,\n"
+		       "  \"loop_iteration_us\": { \"p50\": %.2f, "
+		       "\"p99\": %.2f, \"max\": %.2f }",
+		       (unsigned long long) stats.count,
+		       (unsigned long long) stats.bytes,
+		       stats_percentile_us(&stats, 0.5),
+		       stats_percentile_us(&stats, 0.99),
+		       stats.max_ns / 1000.0);
+	printf("\n}\n");
+
+	wl_array_release(&all);
+	free(server.clients);
+	wl_display_destroy(server.display);
+
+	return failed ? 1 : 0;
+}
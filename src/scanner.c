@@ -66,6 +66,8 @@ struct message {
 	int type_index;
 	int all_null;
 	int destructor;
+	char *signature;
+	int signature_emitted;
 };
 
 enum arg_type {
@@ -198,6 +200,7 @@ start_element(void *data, const char *element_name, const char **atts)
 		message->uppercase_name = uppercase_dup(name);
 		wl_list_init(&message->arg_list);
 		message->arg_count = 0;
+		message->signature_emitted = 0;
 
 		if (strcmp(element_name, "request") == 0)
 			wl_list_insert(ctx->interface->request_list.prev,
@@ -709,48 +712,208 @@ emit_types(struct protocol *protocol, struct wl_list *message_list)
 }
 
 static void
-emit_messages(struct wl_list *message_list,
-	      struct interface *interface, const char *suffix)
+build_signatures(struct wl_list *message_list)
 {
 	struct message *m;
 	struct arg *a;
-
-	if (wl_list_empty(message_list))
-		return;
-
-	printf("static const struct wl_message "
-	       "%s_%s[] = {\n",
-	       interface->name, suffix);
+	int i;
 
 	wl_list_for_each(m, message_list, link) {
-		printf("\t{ \"%s\", \"", m->name);
+		m->signature = malloc(m->arg_count + 1);
+		i = 0;
 		wl_list_for_each(a, &m->arg_list, link) {
 			switch (a->type) {
 			default:
 			case INT:
-				printf("i");
+				m->signature[i++] = 'i';
 				break;
 			case NEW_ID:
-				printf("n");
+				m->signature[i++] = 'n';
 				break;
 			case UNSIGNED:
-				printf("u");
+				m->signature[i++] = 'u';
 				break;
 			case STRING:
-				printf("s");
+				m->signature[i++] = 's';
 				break;
 			case OBJECT:
-				printf("o");
+				m->signature[i++] = 'o';
 				break;
 			case ARRAY:
-				printf("a");
+				m->signature[i++] = 'a';
 				break;
 			case FD:
-				printf("h");
+				m->signature[i++] = 'h';
 				break;
 			}
 		}
-		printf("\", types + %d },\n", m->type_index);
+		m->signature[i] = '\0';
+	}
+}
+
+static const char *
+signature_symbol(const char *prefix, const char *signature)
+{
+	static char name[256];
+
+	snprintf(name, sizeof name, "%s_%s",
+		 prefix, signature[0] ? signature : "none");
+
+	return name;
+}
+
+static const char *
+signature_c_type(char c)
+{
+	switch (c) {
+	case 'i':
+		return "int32_t";
+	case 'n':
+	case 'u':
+		return "uint32_t";
+	case 's':
+		return "const char *";
+	case 'o':
+		return "void *";
+	case 'a':
+		return "struct wl_array *";
+	case 'h':
+	default:
+		return "int";
+	}
+}
+
+static void
+emit_dispatcher(const char *signature)
+{
+	const char *c_type;
+	int i;
+
+	printf("static void\n"
+	       "%s(void (*func)(void), void * const *args)\n"
+	       "{\n"
+	       "\t((void (*)(void *, void *",
+	       signature_symbol("dispatch", signature));
+
+	for (i = 0; signature[i]; i++)
+		printf(", %s", signature_c_type(signature[i]));
+
+	printf(")) func)\n"
+	       "\t\t(*(void **) args[0], *(void **) args[1]");
+
+	for (i = 0; signature[i]; i++) {
+		c_type = signature_c_type(signature[i]);
+		printf(",\n\t\t *(%s%s) args[%d]", c_type,
+		       c_type[strlen(c_type) - 1] == '*' ? "*" : " *", i + 2);
+	}
+
+	printf(");\n"
+	       "}\n\n");
+}
+
+static void
+emit_layout(const char *signature)
+{
+	int i, fixed_size, pointers, arrays, fds;
+
+	fixed_size = 8;
+	pointers = 0;
+	arrays = 0;
+	fds = 0;
+	for (i = 0; signature[i]; i++) {
+		switch (signature[i]) {
+		case 's':
+			pointers++;
+			fixed_size = -1;
+			break;
+		case 'a':
+			arrays++;
+			fixed_size = -1;
+			break;
+		case 'o':
+			pointers++;
+			/* fall through */
+		case 'u':
+		case 'i':
+		case 'n':
+			if (fixed_size > 0)
+				fixed_size += 4;
+			break;
+		case 'h':
+			fds++;
+			break;
+		}
+	}
+
+	printf("static const struct wl_message_layout %s = {\n"
+	       "\t%d, ",
+	       signature_symbol("layout", signature), (int) strlen(signature));
+
+	if (pointers + arrays + fds == 0)
+		printf("0");
+	if (pointers + arrays > 0)
+		printf("%d * sizeof (void *)", pointers + arrays);
+	if (arrays > 0)
+		printf(" + %d * sizeof (struct wl_array)", arrays);
+	if (fds > 0)
+		printf("%s%d * sizeof (int)",
+		       pointers + arrays > 0 ? " + " : "", fds);
+
+	printf(", %d\n"
+	       "};\n\n", fixed_size > 0 ? fixed_size : 0);
+}
+
+/* The dispatchers and layouts only depend on the signature, so emit
+ * one per distinct signature rather than one per message. */
+static void
+emit_signatures(struct protocol *protocol, struct wl_list *message_list)
+{
+	struct interface *i;
+	struct message *m, *other;
+	struct wl_list *list;
+	int seen;
+
+	wl_list_for_each(m, message_list, link) {
+		seen = 0;
+		wl_list_for_each(i, &protocol->interface_list, link) {
+			list = &i->request_list;
+			wl_list_for_each(other, list, link)
+				if (other->signature_emitted &&
+				    strcmp(other->signature, m->signature) == 0)
+					seen = 1;
+			list = &i->event_list;
+			wl_list_for_each(other, list, link)
+				if (other->signature_emitted &&
+				    strcmp(other->signature, m->signature) == 0)
+					seen = 1;
+		}
+
+		if (!seen) {
+			emit_dispatcher(m->signature);
+			emit_layout(m->signature);
+		}
+		m->signature_emitted = 1;
+	}
+}
+
+static void
+emit_messages(struct wl_list *message_list,
+	      struct interface *interface, const char *suffix)
+{
+	struct message *m;
+
+	if (wl_list_empty(message_list))
+		return;
+
+	printf("static const struct wl_message "
+	       "%s_%s[] = {\n",
+	       interface->name, suffix);
+
+	wl_list_for_each(m, message_list, link) {
+		printf("\t{ \"%s\", \"%s\", types + %d, %s, ",
+		       m->name, m->signature, m->type_index,
+		       signature_symbol("dispatch", m->signature));
+		printf("&%s },\n", signature_symbol("layout", m->signature));
 	}
 
 	printf("};\n\n");
@@ -782,6 +945,16 @@ emit_code(struct protocol *protocol)
 	}
 	printf("};\n\n");
 
+	wl_list_for_each(i, &protocol->interface_list, link) {
+		build_signatures(&i->request_list);
+		build_signatures(&i->event_list);
+	}
+
+	wl_list_for_each(i, &protocol->interface_list, link) {
+		emit_signatures(protocol, &i->request_list);
+		emit_signatures(protocol, &i->event_list);
+	}
+
 	wl_list_for_each(i, &protocol->interface_list, link) {
 
 		emit_messages(&i->request_list, i, "requests");
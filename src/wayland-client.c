@@ -56,6 +56,7 @@ struct wl_global {
 	char *interface;
 	uint32_t version;
 	struct wl_list link;
+	struct wl_global *next;
 };
 
 struct wl_display {
@@ -66,6 +67,8 @@ struct wl_display {
 	struct wl_map objects;
 	struct wl_list global_listener_list;
 	struct wl_list global_list;
+	struct wl_hash_table *global_table;
+	struct wl_hash_table *interface_table;
 
 	wl_display_update_func_t update;
 	void *update_data;
@@ -82,6 +85,9 @@ connection_update(struct wl_connection *connection,
 {
 	struct wl_display *display = data;
 
+	if (display->mask == mask)
+		return 0;
+
 	display->mask = mask;
 	if (display->update)
 		return display->update(display->mask,
@@ -163,16 +169,37 @@ wl_proxy_add_listener(struct wl_proxy *proxy,
 WL_EXPORT void
 wl_proxy_marshal(struct wl_proxy *proxy, uint32_t opcode, ...)
 {
-	struct wl_closure *closure;
+	union wl_argument args[WL_CLOSURE_MAX_ARGS];
 	va_list ap;
 
 	va_start(ap, opcode);
-	closure = wl_connection_vmarshal(proxy->display->connection,
-					 &proxy->object, opcode, ap,
-					 &proxy->object.interface->methods[opcode]);
+	wl_argument_from_va_list(proxy->object.interface->methods[opcode].signature,
+				 args, WL_CLOSURE_MAX_ARGS, ap);
 	va_end(ap);
 
-	wl_closure_send(closure, proxy->display->connection);
+	wl_proxy_marshal_array(proxy, opcode, args);
+}
+
+WL_EXPORT void
+wl_proxy_marshal_array(struct wl_proxy *proxy, uint32_t opcode,
+		       union wl_argument *args)
+{
+	struct wl_closure *closure;
+
+	closure = wl_connection_marshal_array(proxy->display->connection,
+					      &proxy->object, opcode, args,
+					      &proxy->object.interface->methods[opcode]);
+
+	if (closure == NULL) {
+		fprintf(stderr, "Error marshalling request: %m\n");
+		return;
+	}
+
+	if (wl_closure_send(closure, proxy->display->connection) < 0) {
+		fprintf(stderr, "Error sending request: %m\n");
+		wl_closure_destroy(closure);
+		return;
+	}
 
 	if (wl_debug)
 		wl_closure_print(closure, &proxy->object, true);
@@ -180,6 +207,17 @@ wl_proxy_marshal(struct wl_proxy *proxy, uint32_t opcode, ...)
 	wl_closure_destroy(closure);
 }
 
+static uint32_t
+hash_interface(const char *interface)
+{
+	uint32_t hash = 5381;
+
+	while (*interface)
+		hash = hash * 33 + (unsigned char) *interface++;
+
+	return hash;
+}
+
 /* Can't do this, there may be more than one instance of an
  * interface... */
 WL_EXPORT uint32_t
@@ -188,7 +226,11 @@ wl_display_get_global(struct wl_display *display,
 {
 	struct wl_global *global;
 
-	wl_list_for_each(global, &display->global_list, link)
+	/* The interface table maps the hash of an interface name to
+	 * the globals sharing it, in the order they were announced. */
+	global = wl_hash_table_lookup(display->interface_table,
+				      hash_interface(interface));
+	for (; global; global = global->next)
 		if (strcmp(interface, global->interface) == 0 &&
 		    version <= global->version)
 			return global->id;
@@ -212,13 +254,26 @@ display_handle_global(void *data,
 		      uint32_t id, const char *interface, uint32_t version)
 {
 	struct wl_global_listener *listener;
-	struct wl_global *global;
+	struct wl_global *global, *last;
+	uint32_t hash;
 
 	global = malloc(sizeof *global);
 	global->id = id;
 	global->interface = strdup(interface);
 	global->version = version;
+	global->next = NULL;
 	wl_list_insert(display->global_list.prev, &global->link);
+	wl_hash_table_insert(display->global_table, id, global);
+
+	hash = hash_interface(interface);
+	last = wl_hash_table_lookup(display->interface_table, hash);
+	if (last == NULL) {
+		wl_hash_table_insert(display->interface_table, hash, global);
+	} else {
+		while (last->next)
+			last = last->next;
+		last->next = global;
+	}
 
 	wl_list_for_each(listener, &display->global_listener_list, link)
 		(*listener->handler)(display,
@@ -229,14 +284,30 @@ static void
 display_handle_global_remove(void *data,
                              struct wl_display *display, uint32_t id)
 {
-	struct wl_global *global;
+	struct wl_global *global, *head, *prev;
+	uint32_t hash;
 
-	wl_list_for_each(global, &display->global_list, link)
-		if (global->id == id) {
-			wl_list_remove(&global->link);
-			free(global);
-			break;
-		}
+	global = wl_hash_table_lookup(display->global_table, id);
+	if (global == NULL)
+		return;
+
+	hash = hash_interface(global->interface);
+	head = wl_hash_table_lookup(display->interface_table, hash);
+	if (head == global) {
+		wl_hash_table_remove(display->interface_table, hash);
+		if (global->next)
+			wl_hash_table_insert(display->interface_table,
+					     hash, global->next);
+	} else {
+		for (prev = head; prev->next != global; prev = prev->next)
+			;
+		prev->next = global->next;
+	}
+
+	wl_hash_table_remove(display->global_table, id);
+	wl_list_remove(&global->link);
+	free(global->interface);
+	free(global);
 }
 
 static const struct wl_display_listener display_listener = {
@@ -318,6 +389,17 @@ wl_display_connect(const char *name)
 		return NULL;
 	}
 
+	display->global_table = wl_hash_table_create();
+	display->interface_table = wl_hash_table_create();
+	if (display->global_table == NULL ||
+	    display->interface_table == NULL) {
+		wl_hash_table_destroy(display->global_table);
+		wl_hash_table_destroy(display->interface_table);
+		close(display->fd);
+		free(display);
+		return NULL;
+	}
+
 	wl_map_init(&display->objects);
 	wl_list_init(&display->global_listener_list);
 	wl_list_init(&display->global_list);
@@ -333,6 +415,8 @@ wl_display_connect(const char *name)
 	display->connection = wl_connection_create(display->fd,
 						   connection_update, display);
 	if (display->connection == NULL) {
+		wl_hash_table_destroy(display->global_table);
+		wl_hash_table_destroy(display->interface_table);
 		wl_map_release(&display->objects);
 		close(display->fd);
 		free(display);
@@ -351,8 +435,12 @@ wl_display_destroy(struct wl_display *display)
 	wl_connection_destroy(display->connection);
 	wl_map_release(&display->objects);
 	wl_list_for_each_safe(global, gnext,
-			      &display->global_list, link)
+			      &display->global_list, link) {
+		free(global->interface);
 		free(global);
+	}
+	wl_hash_table_destroy(display->global_table);
+	wl_hash_table_destroy(display->interface_table);
 	wl_list_for_each_safe(listener, lnext,
 			      &display->global_listener_list, link)
 		free(listener);
@@ -404,12 +492,10 @@ static void
 handle_event(struct wl_display *display,
 	     uint32_t id, uint32_t opcode, uint32_t size)
 {
-	uint32_t p[32];
 	struct wl_proxy *proxy;
 	struct wl_closure *closure;
 	const struct wl_message *message;
 
-	wl_connection_copy(display->connection, p, size);
 	proxy = wl_map_lookup(&display->objects, id);
 
 	if (proxy == NULL || proxy->object.implementation == NULL) {
@@ -33,6 +33,8 @@ struct wl_proxy;
 struct wl_display;
 
 void wl_proxy_marshal(struct wl_proxy *p, uint32_t opcode, ...);
+void wl_proxy_marshal_array(struct wl_proxy *p, uint32_t opcode,
+			    union wl_argument *args);
 struct wl_proxy *wl_proxy_create(struct wl_proxy *factory,
 				 const struct wl_interface *interface);
 struct wl_proxy *wl_proxy_create_for_id(struct wl_display *display,
@@ -24,6 +24,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -44,6 +45,13 @@
 #include "wayland-server.h"
 #include "wayland-server-protocol.h"
 #include "connection.h"
+#include "io-uring.h"
+#include "event-loop.h"
+
+/* Max number of client flushes submitted to io_uring at once. */
+#define WL_FLUSH_BATCH 32
+#define WL_FLUSH_PENDING INT_MIN
+#define WL_FLUSH_LOST (INT_MIN + 1)
 
 struct wl_socket {
 	int fd;
@@ -61,10 +69,33 @@ struct wl_client {
 	uint32_t id_count;
 	uint32_t mask;
 	struct wl_list link;
+	struct wl_list dirty_link;
 	struct wl_map objects;
+	struct wl_hash_table *bindings;
+	struct wl_list missing_list;
+	int corked;
 	int error;
 };
 
+/* A resource of the client's, indexed in client->bindings by the
+ * object it stands for, such as an input device, and the resource's
+ * interface.  Bindings that hash the same are chained in the order
+ * they were made.  A binding without a resource records that the
+ * client has none; it sits on client->missing_list until the client
+ * gets a new resource of that interface. */
+struct wl_client_binding {
+	struct wl_client *client;
+	void *data;
+	const struct wl_interface *interface;
+	struct wl_resource *resource;
+	struct wl_listener destroy_listener;
+	struct wl_list link;
+	struct wl_client_binding *next;
+};
+
+static void wl_client_forget_missing(struct wl_client *client,
+				     const struct wl_interface *interface);
+
 struct wl_display {
 	struct wl_event_loop *loop;
 	int run;
@@ -73,8 +104,20 @@ struct wl_display {
 	uint32_t id;
 
 	struct wl_list global_list;
+	struct wl_hash_table *global_table;
 	struct wl_list socket_list;
 	struct wl_list client_list;
+
+	struct wl_list dirty_list;
+	struct wl_event_source *flush_source;
+	struct wl_io_uring *uring;
+
+	wl_client_overflow_func_t overflow_handler;
+	void *overflow_data;
+
+	uint32_t request_budget;
+
+	int socket_backlog;
 };
 
 struct wl_global {
@@ -87,20 +130,73 @@ struct wl_global {
 
 static int wl_debug = 0;
 
+static void
+wl_client_mark_dirty(struct wl_client *client);
+
 WL_EXPORT void
 wl_resource_post_event(struct wl_resource *resource, uint32_t opcode, ...)
 {
-	struct wl_closure *closure;
+	union wl_argument args[WL_CLOSURE_MAX_ARGS];
 	struct wl_object *object = &resource->object;
 	va_list ap;
 
 	va_start(ap, opcode);
-	closure = wl_connection_vmarshal(resource->client->connection,
-					 object, opcode, ap,
-					 &object->interface->events[opcode]);
+	wl_argument_from_va_list(object->interface->events[opcode].signature,
+				 args, WL_CLOSURE_MAX_ARGS, ap);
 	va_end(ap);
 
-	wl_closure_send(closure, resource->client->connection);
+	wl_resource_post_event_array(resource, opcode, args);
+}
+
+static void
+wl_client_overflow(struct wl_client *client,
+		   struct wl_resource *resource, uint32_t opcode)
+{
+	struct wl_display *display = client->display;
+	enum wl_client_overflow_action action;
+
+	/* Already on its way out, nothing more to say to it. */
+	if (client->error)
+		return;
+
+	if (display->overflow_handler)
+		action = display->overflow_handler(client, resource, opcode,
+						   display->overflow_data);
+	else
+		action = WL_CLIENT_OVERFLOW_DISCONNECT;
+
+	if (action == WL_CLIENT_OVERFLOW_DROP)
+		return;
+
+	fprintf(stderr, "client %p not reading, disconnecting\n", client);
+
+	/* We may be deep inside a request handler or holding on to
+	 * this client's resources, so let the flush destroy it. */
+	client->error = 1;
+	wl_client_mark_dirty(client);
+}
+
+WL_EXPORT void
+wl_resource_post_event_array(struct wl_resource *resource, uint32_t opcode,
+			     union wl_argument *args)
+{
+	struct wl_closure *closure;
+	struct wl_object *object = &resource->object;
+
+	closure = wl_connection_marshal_array(resource->client->connection,
+					      object, opcode, args,
+					      &object->interface->events[opcode]);
+
+	if (closure == NULL) {
+		fprintf(stderr, "Error marshalling event: %m\n");
+		return;
+	}
+
+	if (wl_closure_send(closure, resource->client->connection) < 0) {
+		wl_closure_destroy(closure);
+		wl_client_overflow(resource->client, resource, opcode);
+		return;
+	}
 
 	if (wl_debug)
 		wl_closure_print(closure, object, true);
@@ -108,6 +204,89 @@ wl_resource_post_event(struct wl_resource *resource, uint32_t opcode, ...)
 	wl_closure_destroy(closure);
 }
 
+/* Marshal an event once into encoded, so it can be copied as is to
+ * every resource of the same interface.  Only the leading object id
+ * differs between recipients, so events carrying objects, new ids or
+ * fds, which are all specific to one client, can't be shared.  In
+ * that case, or when debugging, we return -1 and the caller posts
+ * each event the usual way. */
+static int
+wl_resource_encode_event(struct wl_resource *resource, uint32_t opcode,
+			 union wl_argument *args, struct wl_array *encoded)
+{
+	const struct wl_message *message;
+	struct wl_closure *closure;
+	int ret;
+
+	message = &resource->object.interface->events[opcode];
+	if (wl_debug || strpbrk(message->signature, "onh"))
+		return -1;
+
+	closure = wl_connection_marshal_array(resource->client->connection,
+					      &resource->object, opcode, args,
+					      message);
+	if (closure == NULL)
+		return -1;
+
+	ret = wl_closure_copy(closure, encoded);
+	wl_closure_destroy(closure);
+
+	return ret;
+}
+
+static void
+wl_resource_post_encoded(struct wl_resource *resource, uint32_t opcode,
+			 struct wl_array *encoded)
+{
+	uint32_t *p = encoded->data;
+
+	p[0] = resource->object.id;
+	if (wl_connection_write(resource->client->connection,
+				p, encoded->size) < 0)
+		wl_client_overflow(resource->client, resource, opcode);
+}
+
+WL_EXPORT void
+wl_resource_list_post_event(struct wl_list *list, uint32_t opcode, ...)
+{
+	union wl_argument args[WL_CLOSURE_MAX_ARGS];
+	struct wl_resource *resource;
+	va_list ap;
+
+	if (wl_list_empty(list))
+		return;
+
+	resource = container_of(list->next, struct wl_resource, link);
+	va_start(ap, opcode);
+	wl_argument_from_va_list(resource->object.interface->events[opcode].signature,
+				 args, WL_CLOSURE_MAX_ARGS, ap);
+	va_end(ap);
+
+	wl_resource_list_post_event_array(list, opcode, args);
+}
+
+WL_EXPORT void
+wl_resource_list_post_event_array(struct wl_list *list, uint32_t opcode,
+				  union wl_argument *args)
+{
+	struct wl_resource *resource, *next;
+	struct wl_array encoded;
+
+	if (wl_list_empty(list))
+		return;
+
+	resource = container_of(list->next, struct wl_resource, link);
+	wl_array_init(&encoded);
+	if (wl_resource_encode_event(resource, opcode, args, &encoded) < 0) {
+		wl_list_for_each_safe(resource, next, list, link)
+			wl_resource_post_event_array(resource, opcode, args);
+	} else {
+		wl_list_for_each_safe(resource, next, list, link)
+			wl_resource_post_encoded(resource, opcode, &encoded);
+	}
+	wl_array_release(&encoded);
+}
+
 WL_EXPORT void
 wl_resource_post_error(struct wl_resource *resource,
 		       uint32_t code, const char *msg, ...)
@@ -135,7 +314,7 @@ wl_client_connection_data(int fd, uint32_t mask, void *data)
 	struct wl_closure *closure;
 	const struct wl_message *message;
 	uint32_t p[2], opcode, size;
-	uint32_t cmask = 0;
+	uint32_t cmask = 0, count = 0, budget, consumed = 0;
 	int len;
 
 	if (mask & WL_EVENT_READABLE)
@@ -149,7 +328,16 @@ wl_client_connection_data(int fd, uint32_t mask, void *data)
 		return 1;
 	}
 
+	budget = client->display->request_budget;
 	while (len >= sizeof p) {
+		/* Out of budget: leave the rest in the buffer and have the
+		 * loop call us again once the other sources had a go. */
+		if (budget && count == budget) {
+			wl_event_source_add_bytes(client->source, consumed);
+			wl_event_source_defer(client->source);
+			return 1;
+		}
+
 		wl_connection_copy(connection, p, sizeof p);
 		opcode = p[1] & 0xffff;
 		size = p[1] >> 16;
@@ -178,6 +366,7 @@ wl_client_connection_data(int fd, uint32_t mask, void *data)
 		closure = wl_connection_demarshal(client->connection, size,
 						  &client->objects, message);
 		len -= size;
+		consumed += size;
 
 		if (closure == NULL && errno == EINVAL) {
 			wl_resource_post_error(resource,
@@ -199,31 +388,56 @@ wl_client_connection_data(int fd, uint32_t mask, void *data)
 				  object->implementation[opcode], client);
 
 		wl_closure_destroy(closure);
+		count++;
 
 		if (client->error)
 			break;
 	}
 
+	wl_event_source_add_bytes(client->source, consumed);
 	if (client->error)
 		wl_client_destroy(client);
 
 	return 1;
 }
 
+static void
+flush_idle(void *data)
+{
+	struct wl_display *display = data;
+
+	wl_display_flush_clients(display);
+}
+
+static void
+wl_client_mark_dirty(struct wl_client *client)
+{
+	struct wl_display *display = client->display;
+
+	if (!wl_list_empty(&client->dirty_link))
+		return;
+
+	wl_list_insert(display->dirty_list.prev, &client->dirty_link);
+	wl_event_source_idle_rearm(display->flush_source);
+}
+
+/* Rather than asking epoll for a writable wakeup every time the out
+ * buffer becomes non-empty, queue the client on the display's dirty
+ * list; all dirty clients are flushed once, before the loop goes back
+ * to sleep.  We only poll for writable if a flush comes up short. */
 static int
 wl_client_connection_update(struct wl_connection *connection,
 			    uint32_t mask, void *data)
 {
 	struct wl_client *client = data;
-	uint32_t emask = 0;
 
 	client->mask = mask;
-	if (mask & WL_CONNECTION_READABLE)
-		emask |= WL_EVENT_READABLE;
-	if (mask & WL_CONNECTION_WRITABLE)
-		emask |= WL_EVENT_WRITEABLE;
+	if (mask & WL_CONNECTION_WRITABLE) {
+		wl_client_mark_dirty(client);
+		return 0;
+	}
 
-	return wl_event_source_fd_update(client->source, emask);
+	return wl_event_source_fd_update(client->source, WL_EVENT_READABLE);
 }
 
 WL_EXPORT void
@@ -233,6 +447,188 @@ wl_client_flush(struct wl_client *client)
 		wl_connection_data(client->connection, WL_CONNECTION_WRITABLE);
 }
 
+/* Hold back the end-of-dispatch flush for this client until a matching
+ * wl_client_uncork(), so a burst of events goes out in one write. */
+WL_EXPORT void
+wl_client_cork(struct wl_client *client)
+{
+	client->corked++;
+}
+
+WL_EXPORT void
+wl_client_uncork(struct wl_client *client)
+{
+	if (client->corked == 0)
+		return;
+
+	client->corked--;
+	if (client->corked == 0 && (client->mask & WL_CONNECTION_WRITABLE))
+		wl_client_mark_dirty(client);
+}
+
+WL_EXPORT void
+wl_display_set_overflow_handler(struct wl_display *display,
+				wl_client_overflow_func_t handler, void *data)
+{
+	display->overflow_handler = handler;
+	display->overflow_data = data;
+}
+
+WL_EXPORT void
+wl_display_set_request_budget(struct wl_display *display, uint32_t budget)
+{
+	display->request_budget = budget;
+}
+
+static int
+wl_display_submit_flushes(struct wl_display *display,
+			  struct wl_connection_sendmsg *ops, int *res, int n)
+{
+	unsigned int accepted;
+	char done[WL_FLUSH_BATCH];
+	uint64_t i;
+	int j, r, ret;
+
+	for (j = 0; j < n; j++)
+		if (wl_io_uring_queue_sendmsg(display->uring, ops[j].fd,
+					      &ops[j].msg,
+					      MSG_NOSIGNAL | MSG_DONTWAIT,
+					      j) < 0)
+			return -1;
+
+	ret = wl_io_uring_submit_and_wait(display->uring, &accepted);
+	memset(done, 0, sizeof done);
+
+	/* Pick up what did complete even if something went wrong.  A
+	 * kernel without the sendmsg op fails it with -EINVAL before
+	 * sending anything, so those are safe to redo with sendmsg(). */
+	while (wl_io_uring_reap(display->uring, &i, &r)) {
+		done[i] = 1;
+		if (r == -EINVAL || r == -EOPNOTSUPP) {
+			ret = -1;
+			continue;
+		}
+		res[i] = r;
+	}
+
+	/* Entries the kernel took but never completed may still go
+	 * out, so sending them again could duplicate data.  Only the
+	 * ones it never took are left for the sendmsg() fallback. */
+	for (j = 0; j < (int) accepted && j < n; j++)
+		if (!done[j])
+			res[j] = WL_FLUSH_LOST;
+
+	return ret;
+}
+
+static void
+wl_display_flush_batch(struct wl_display *display, struct wl_client **batch,
+		       struct wl_connection_sendmsg *ops, int n)
+{
+	struct wl_client *client;
+	int res[WL_FLUSH_BATCH], i, len;
+
+	for (i = 0; i < n; i++)
+		res[i] = WL_FLUSH_PENDING;
+
+	/* A single client isn't worth the submission overhead. */
+	if (n > 1 && display->uring &&
+	    wl_display_submit_flushes(display, ops, res, n) < 0) {
+		fprintf(stderr, "io_uring submission failed, "
+			"falling back to sendmsg: %m\n");
+		wl_io_uring_destroy(display->uring);
+		display->uring = NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		client = batch[i];
+
+		if (res[i] == WL_FLUSH_LOST) {
+			errno = EIO;
+			len = -1;
+		} else if (res[i] != WL_FLUSH_PENDING) {
+			len = res[i];
+			if (len < 0) {
+				errno = -len;
+				len = -1;
+			}
+		} else {
+			do {
+				len = sendmsg(ops[i].fd, &ops[i].msg,
+					      MSG_NOSIGNAL);
+			} while (len < 0 && errno == EINTR);
+		}
+
+		/* Later ops still point into other clients' out buffers,
+		 * which destroy handlers could grow by posting events.
+		 * Leave the client for wl_display_flush_clients() to
+		 * destroy once the batch is done. */
+		if (wl_connection_sendmsg_done(client->connection, len) < 0) {
+			client->error = 1;
+			wl_client_mark_dirty(client);
+			continue;
+		}
+
+		/* Partial write, let epoll tell us when to send the rest. */
+		if (client->mask & WL_CONNECTION_WRITABLE)
+			wl_event_source_fd_update(client->source,
+						  WL_EVENT_READABLE |
+						  WL_EVENT_WRITEABLE);
+	}
+}
+
+/* Flush the dirty clients in batches.  Where io_uring is available,
+ * all the sendmsg()s of a batch go to the kernel in one syscall. */
+WL_EXPORT void
+wl_display_flush_clients(struct wl_display *display)
+{
+	struct wl_connection_sendmsg ops[WL_FLUSH_BATCH];
+	struct wl_client *batch[WL_FLUSH_BATCH], *client;
+	int n;
+
+	while (!wl_list_empty(&display->dirty_list)) {
+		n = 0;
+		while (!wl_list_empty(&display->dirty_list) &&
+		       n < WL_FLUSH_BATCH) {
+			client = container_of(display->dirty_list.next,
+					      struct wl_client, dirty_link);
+			wl_list_remove(&client->dirty_link);
+			wl_list_init(&client->dirty_link);
+
+			/* Don't destroy it under the ops already prepared,
+			 * flush those first. */
+			if (client->error && n > 0) {
+				wl_list_insert(&display->dirty_list,
+					       &client->dirty_link);
+				break;
+			}
+
+			if (client->error) {
+				wl_client_destroy(client);
+				continue;
+			}
+
+			if (client->corked ||
+			    !(client->mask & WL_CONNECTION_WRITABLE))
+				continue;
+
+			if (wl_connection_prepare_sendmsg(client->connection,
+							  &ops[n]))
+				batch[n++] = client;
+		}
+
+		wl_display_flush_batch(display, batch, ops, n);
+	}
+}
+
+/* The connection buffers start small and grow on demand to absorb
+ * bursts of events; this caps how large each of them may get. */
+WL_EXPORT void
+wl_client_set_max_buffer_size(struct wl_client *client, size_t size)
+{
+	wl_connection_set_max_buffer_size(client->connection, size);
+}
+
 WL_EXPORT struct wl_display *
 wl_client_get_display(struct wl_client *client)
 {
@@ -247,6 +643,17 @@ WL_EXPORT struct wl_client *
 wl_client_create(struct wl_display *display, int fd)
 {
 	struct wl_client *client;
+	int flags;
+
+	/* A client that stops reading must never block us in sendmsg;
+	 * its events queue up to the max buffer size instead. */
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 ||
+	    (!(flags & O_NONBLOCK) &&
+	     fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)) {
+		fprintf(stderr, "failed to make client fd non-blocking: %m\n");
+		return NULL;
+	}
 
 	client = malloc(sizeof *client);
 	if (client == NULL)
@@ -254,6 +661,8 @@ wl_client_create(struct wl_display *display, int fd)
 
 	memset(client, 0, sizeof *client);
 	client->display = display;
+	wl_list_init(&client->dirty_link);
+	wl_list_init(&client->missing_list);
 	client->source = wl_event_loop_add_fd(display->loop, fd,
 					      WL_EVENT_READABLE,
 					      wl_client_connection_data, client);
@@ -286,6 +695,7 @@ wl_client_add_resource(struct wl_client *client,
 	resource->client = client;
 	wl_list_init(&resource->destroy_listener_list);
 	wl_map_insert_at(&client->objects, resource->object.id, resource);
+	wl_client_forget_missing(client, resource->object.interface);
 }
 
 WL_EXPORT void
@@ -321,6 +731,7 @@ wl_resource_destroy(struct wl_resource *resource, uint32_t time)
 WL_EXPORT void
 wl_client_destroy(struct wl_client *client)
 {
+	struct wl_client_binding *binding, *next;
 	uint32_t time = 0;
 	
 	printf("disconnect from client %p\n", client);
@@ -328,12 +739,148 @@ wl_client_destroy(struct wl_client *client)
 	wl_client_flush(client);
 	wl_map_for_each(&client->objects, destroy_resource, &time);
 	wl_map_release(&client->objects);
+	wl_list_for_each_safe(binding, next, &client->missing_list, link)
+		free(binding);
+	wl_hash_table_destroy(client->bindings);
+	wl_list_remove(&client->dirty_link);
 	wl_event_source_remove(client->source);
 	wl_connection_destroy(client->connection);
 	wl_list_remove(&client->link);
 	free(client);
 }
 
+static uint32_t
+hash_pointer(const void *data)
+{
+	uint64_t p = (uintptr_t) data;
+
+	return p ^ (p >> 32);
+}
+
+static uint32_t
+hash_binding(void *data, const struct wl_interface *interface)
+{
+	return hash_pointer(data) * 31 + hash_pointer(interface);
+}
+
+static void
+wl_client_remove_binding(struct wl_client *client,
+			 struct wl_client_binding *binding)
+{
+	struct wl_client_binding *head, *prev;
+	uint32_t hash;
+
+	hash = hash_binding(binding->data, binding->interface);
+	head = wl_hash_table_lookup(client->bindings, hash);
+	if (head == binding) {
+		wl_hash_table_remove(client->bindings, hash);
+		if (binding->next)
+			wl_hash_table_insert(client->bindings,
+					     hash, binding->next);
+	} else {
+		for (prev = head; prev->next != binding; prev = prev->next)
+			;
+		prev->next = binding->next;
+	}
+
+	free(binding);
+}
+
+static void
+wl_client_binding_destroy(struct wl_listener *listener,
+			  struct wl_resource *resource, uint32_t time)
+{
+	struct wl_client_binding *binding =
+		container_of(listener, struct wl_client_binding,
+			     destroy_listener);
+
+	wl_client_remove_binding(binding->client, binding);
+}
+
+/* A new resource of this interface may be the one an earlier lookup
+ * found missing, so drop those answers. */
+static void
+wl_client_forget_missing(struct wl_client *client,
+			 const struct wl_interface *interface)
+{
+	struct wl_client_binding *binding, *next;
+
+	wl_list_for_each_safe(binding, next, &client->missing_list, link) {
+		if (binding->interface != interface)
+			continue;
+		wl_list_remove(&binding->link);
+		wl_client_remove_binding(client, binding);
+	}
+}
+
+/* Record that resource, or with a NULL resource no resource at all,
+ * is what the client has of interface for data.  The index is only a
+ * cache of what the lookup found, so when there's no memory for the
+ * entry the next lookup just has to search again. */
+static void
+wl_client_add_binding(struct wl_client *client, void *data,
+		      const struct wl_interface *interface,
+		      struct wl_resource *resource)
+{
+	struct wl_client_binding *binding, *last;
+	uint32_t hash;
+
+	if (client->bindings == NULL) {
+		client->bindings = wl_hash_table_create();
+		if (client->bindings == NULL)
+			return;
+	}
+
+	binding = malloc(sizeof *binding);
+	if (binding == NULL)
+		return;
+
+	binding->client = client;
+	binding->data = data;
+	binding->interface = interface;
+	binding->resource = resource;
+	binding->next = NULL;
+
+	hash = hash_binding(data, interface);
+	last = wl_hash_table_lookup(client->bindings, hash);
+	if (last == NULL) {
+		if (wl_hash_table_insert(client->bindings, hash, binding) < 0) {
+			free(binding);
+			return;
+		}
+	} else {
+		while (last->next)
+			last = last->next;
+		last->next = binding;
+	}
+
+	if (resource) {
+		binding->destroy_listener.func = wl_client_binding_destroy;
+		wl_list_insert(resource->destroy_listener_list.prev,
+			       &binding->destroy_listener.link);
+	} else {
+		wl_list_insert(&client->missing_list, &binding->link);
+	}
+}
+
+static struct wl_client_binding *
+wl_client_find_binding(struct wl_client *client, void *data,
+		       const struct wl_interface *interface)
+{
+	struct wl_client_binding *binding;
+
+	if (client->bindings == NULL)
+		return NULL;
+
+	binding = wl_hash_table_lookup(client->bindings,
+				       hash_binding(data, interface));
+	for (; binding; binding = binding->next)
+		if (binding->data == data && binding->interface == interface)
+			return binding;
+
+	return NULL;
+}
+
 static void
 lose_pointer_focus(struct wl_listener *listener,
 		   struct wl_resource *resource, uint32_t time)
@@ -371,18 +918,37 @@ wl_input_device_init(struct wl_input_device *device,
 }
 
 static struct wl_resource *
-find_resource_for_surface(struct wl_list *list, struct wl_surface *surface)
+find_resource_for_surface(struct wl_input_device *device,
+			  struct wl_surface *surface)
 {
+	struct wl_client *client;
+	struct wl_client_binding *binding;
 	struct wl_resource *r;
 
 	if (!surface)
 		return NULL;
 
-	wl_list_for_each(r, list, link) {
-		if (r->client == surface->resource.client)
+	/* The device's resource list is what the compositor says the
+	 * client's resources for it are.  Look through it once and keep
+	 * the answer: a resource until it's destroyed, none until the
+	 * client gets a new input device resource. */
+	client = surface->resource.client;
+	binding = wl_client_find_binding(client, device,
+					 &wl_input_device_interface);
+	if (binding)
+		return binding->resource;
+
+	wl_list_for_each(r, &device->resource_list, link) {
+		if (r->client == client) {
+			wl_client_add_binding(client, device,
+					      &wl_input_device_interface, r);
 			return r;
+		}
 	}
 
+	wl_client_add_binding(client, device,
+			      &wl_input_device_interface, NULL);
+
 	return NULL;
 }
 
@@ -407,7 +973,7 @@ wl_input_device_set_pointer_focus(struct wl_input_device *device,
 	if (device->pointer_focus_resource)
 		wl_list_remove(&device->pointer_focus_listener.link);
 
-	resource = find_resource_for_surface(&device->resource_list, surface);
+	resource = find_resource_for_surface(device, surface);
 	if (resource) {
 		wl_resource_post_event(resource,
 				       WL_INPUT_DEVICE_POINTER_FOCUS,
@@ -440,7 +1006,7 @@ wl_input_device_set_keyboard_focus(struct wl_input_device *device,
 	if (device->keyboard_focus_resource)
 		wl_list_remove(&device->keyboard_focus_listener.link);
 
-	resource = find_resource_for_surface(&device->resource_list, surface);
+	resource = find_resource_for_surface(device, surface);
 	if (resource) {
 		wl_resource_post_event(resource,
 				       WL_INPUT_DEVICE_KEYBOARD_FOCUS,
@@ -522,16 +1088,15 @@ display_bind(struct wl_client *client,
 	struct wl_global *global;
 	struct wl_display *display = resource->data;
 
-	wl_list_for_each(global, &display->global_list, link)
-		if (global->name == name)
-			break;
-
-	if (&global->link == &display->global_list)
+	global = wl_hash_table_lookup(display->global_table, name);
+	if (global == NULL) {
 		wl_resource_post_error(resource,
 				       WL_DISPLAY_ERROR_INVALID_OBJECT,
 				       "invalid global %d", name);
-	else
-		global->bind(client, global->data, version, id);
+		return;
+	}
+
+	global->bind(client, global->data, version, id);
 }
 
 static void
@@ -590,15 +1155,45 @@ wl_display_create(void)
 		return NULL;
 	}
 
+	display->global_table = wl_hash_table_create();
+	if (display->global_table == NULL) {
+		wl_event_loop_destroy(display->loop);
+		free(display);
+		return NULL;
+	}
+
 	wl_list_init(&display->callback_list);
 	wl_list_init(&display->global_list);
 	wl_list_init(&display->socket_list);
 	wl_list_init(&display->client_list);
+	wl_list_init(&display->dirty_list);
+	display->overflow_handler = NULL;
+	display->overflow_data = NULL;
+	display->request_budget = 0;
+	display->socket_backlog = 128;
 
 	display->id = 1;
 
+	display->flush_source =
+		wl_event_loop_add_persistent_idle(display->loop,
+						  flush_idle, display);
+	if (display->flush_source == NULL) {
+		wl_hash_table_destroy(display->global_table);
+		wl_event_loop_destroy(display->loop);
+		free(display);
+		return NULL;
+	}
+
+	/* Optional, we fall back to sendmsg() without it. */
+	display->uring = NULL;
+	if (getenv("WAYLAND_SERVER_NO_IO_URING") == NULL)
+		display->uring = wl_io_uring_create(WL_FLUSH_BATCH);
+
 	if (!wl_display_add_global(display, &wl_display_interface, 
 				   display, bind_display)) {
+		if (display->uring)
+			wl_io_uring_destroy(display->uring);
+		wl_hash_table_destroy(display->global_table);
 		wl_event_loop_destroy(display->loop);
 		free(display);
 		return NULL;
@@ -613,6 +1208,9 @@ wl_display_destroy(struct wl_display *display)
 	struct wl_socket *s, *next;
 	struct wl_global *global, *gnext;
 
+	wl_event_source_remove(display->flush_source);
+	if (display->uring)
+		wl_io_uring_destroy(display->uring);
   	wl_event_loop_destroy(display->loop);
 	wl_list_for_each_safe(s, next, &display->socket_list, link) {
 		close(s->fd);
@@ -624,6 +1222,7 @@ wl_display_destroy(struct wl_display *display)
 
 	wl_list_for_each_safe(global, gnext, &display->global_list, link)
 		free(global);
+	wl_hash_table_destroy(display->global_table);
 
 	free(display);
 }
@@ -643,6 +1242,11 @@ wl_display_add_global(struct wl_display *display,
 	global->interface = interface;
 	global->data = data;
 	global->bind = bind;
+	if (wl_hash_table_insert(display->global_table,
+				 global->name, global) < 0) {
+		free(global);
+		return NULL;
+	}
 	wl_list_insert(display->global_list.prev, &global->link);
 
 	return global;
@@ -652,10 +1256,32 @@ WL_EXPORT void
 wl_display_remove_global(struct wl_display *display, struct wl_global *global)
 {
 	struct wl_client *client;
+	union wl_argument args[1];
+	struct wl_array encoded;
+	int shared = 0;
+
+	args[0].u = global->name;
+	wl_array_init(&encoded);
+	if (!wl_list_empty(&display->client_list)) {
+		client = container_of(display->client_list.next,
+				      struct wl_client, link);
+		shared = wl_resource_encode_event(client->display_resource,
+						  WL_DISPLAY_GLOBAL_REMOVE,
+						  args, &encoded) == 0;
+	}
 
 	wl_list_for_each(client, &display->client_list, link)
-		wl_resource_post_event(client->display_resource,
-				       WL_DISPLAY_GLOBAL_REMOVE, global->name);
+		if (shared)
+			wl_resource_post_encoded(client->display_resource,
+						 WL_DISPLAY_GLOBAL_REMOVE,
+						 &encoded);
+		else
+			wl_resource_post_event_array(client->display_resource,
+						     WL_DISPLAY_GLOBAL_REMOVE,
+						     args);
+	wl_array_release(&encoded);
+
+	wl_hash_table_remove(display->global_table, global->name);
 	wl_list_remove(&global->link);
 	free(global);
 }
@@ -682,26 +1308,46 @@ wl_display_run(struct wl_display *display)
 }
 
 static int
-socket_data(int fd, uint32_t mask, void *data)
+accept_client(int fd)
 {
-	struct wl_display *display = data;
 	struct sockaddr_un name;
 	socklen_t length;
 	int client_fd;
 
 	length = sizeof name;
-	client_fd =
-		accept4(fd, (struct sockaddr *) &name, &length, SOCK_CLOEXEC);
+	client_fd = accept4(fd, (struct sockaddr *) &name, &length,
+			    SOCK_CLOEXEC | SOCK_NONBLOCK);
 	if (client_fd < 0 && errno == ENOSYS) {
 		client_fd = accept(fd, (struct sockaddr *) &name, &length);
 		if (client_fd >= 0 && fcntl(client_fd, F_SETFD, FD_CLOEXEC) == -1)
 			fprintf(stderr, "failed to set FD_CLOEXEC flag on client fd, errno: %d\n", errno);
 	}
 
-	if (client_fd < 0)
-		fprintf(stderr, "failed to accept, errno: %d\n", errno);
+	return client_fd;
+}
+
+/* The listening socket is non-blocking, so take every pending
+ * connection in one go rather than one per wakeup. */
+static int
+socket_data(int fd, uint32_t mask, void *data)
+{
+	struct wl_display *display = data;
+	int client_fd;
 
-	wl_client_create(display, client_fd);
+	for (;;) {
+		client_fd = accept_client(fd);
+		if (client_fd < 0 && errno == EINTR)
+			continue;
+		if (client_fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				fprintf(stderr,
+					"failed to accept, errno: %d\n", errno);
+			break;
+		}
+
+		if (wl_client_create(display, client_fd) == NULL)
+			close(client_fd);
+	}
 
 	return 1;
 }
@@ -748,6 +1394,12 @@ get_socket_lock(struct wl_socket *socket, socklen_t name_size)
 	return 0;
 }
 
+WL_EXPORT void
+wl_display_set_socket_backlog(struct wl_display *display, int backlog)
+{
+	display->socket_backlog = backlog;
+}
+
 WL_EXPORT int
 wl_display_add_socket(struct wl_display *display, const char *name)
 {
@@ -759,7 +1411,7 @@ wl_display_add_socket(struct wl_display *display, const char *name)
 	if (s == NULL)
 		return -1;
 
-	s->fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	s->fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
 	if (s->fd < 0) {
 		free(s);
 		return -1;
@@ -797,7 +1449,7 @@ wl_display_add_socket(struct wl_display *display, const char *name)
 		return -1;
 	}
 
-	if (listen(s->fd, 1) < 0) {
+	if (listen(s->fd, display->socket_backlog) < 0) {
 		close(s->fd);
 		unlink(s->addr.sun_path);
 		free(s);
@@ -845,6 +1497,8 @@ wl_client_add_object(struct wl_client *client,
 		return NULL;
 	}
 
+	wl_client_forget_missing(client, interface);
+
 	return resource;
 }
 
@@ -42,8 +42,13 @@ typedef int (*wl_event_loop_fd_func_t)(int fd, uint32_t mask, void *data);
 typedef int (*wl_event_loop_timer_func_t)(void *data);
 typedef int (*wl_event_loop_signal_func_t)(int signal_number, void *data);
 typedef void (*wl_event_loop_idle_func_t)(void *data);
+typedef void (*wl_event_loop_task_func_t)(void *data);
 
 struct wl_event_loop *wl_event_loop_create(void);
+
+/* Sources still in the loop are removed with it, so their callbacks
+ * are never called again, but their memory is only released once
+ * each of them is also passed to wl_event_source_remove(). */
 void wl_event_loop_destroy(struct wl_event_loop *loop);
 struct wl_event_source *wl_event_loop_add_fd(struct wl_event_loop *loop,
 					     int fd, uint32_t mask,
@@ -61,16 +66,88 @@ wl_event_loop_add_signal(struct wl_event_loop *loop,
 
 int wl_event_source_timer_update(struct wl_event_source *source,
 				 int ms_delay);
+
+/* Arm a timer with nanosecond resolution.  With WL_EVENT_TIMER_ABSTIME
+ * it_value is an absolute CLOCK_MONOTONIC deadline, otherwise it's
+ * relative to now.  A non-zero it_interval makes the timer periodic,
+ * firing on the it_value + k * it_interval grid without drift.  A zero
+ * it_value disarms the timer. */
+enum {
+	WL_EVENT_TIMER_ABSTIME = 0x01
+};
+
+struct itimerspec;
+int wl_event_source_timer_settime(struct wl_event_source *source,
+				  uint32_t flags,
+				  const struct itimerspec *its);
 int wl_event_source_remove(struct wl_event_source *source);
 void wl_event_source_check(struct wl_event_source *source);
 
+/* Ready sources are dispatched in order of priority class.  Timers
+ * are all dispatched together at WL_EVENT_PRIORITY_TIMER, new fd and
+ * signal sources start out at WL_EVENT_PRIORITY_DEFAULT.  Idle
+ * sources always run after all of them, before the loop blocks again.
+ * Setting the priority of a timer or idle source fails with EINVAL. */
+enum wl_event_priority {
+	WL_EVENT_PRIORITY_HIGH,
+	WL_EVENT_PRIORITY_TIMER,
+	WL_EVENT_PRIORITY_DEFAULT,
+	WL_EVENT_PRIORITY_LOW
+};
+
+int wl_event_source_set_priority(struct wl_event_source *source,
+				 enum wl_event_priority priority);
+
 
 int wl_event_loop_dispatch(struct wl_event_loop *loop, int timeout);
+void wl_event_loop_set_dispatch_budget(struct wl_event_loop *loop,
+				       uint64_t budget);
 struct wl_event_source *wl_event_loop_add_idle(struct wl_event_loop *loop,
 					       wl_event_loop_idle_func_t func,
 					       void *data);
+
+/* An idle source that survives being dispatched.  It's created
+ * disarmed; each wl_event_source_idle_rearm() schedules one more call
+ * and it stays around until wl_event_source_remove().  A rearm from
+ * inside an idle callback, its own included, takes effect on the next
+ * iteration of the loop. */
+struct wl_event_source *
+wl_event_loop_add_persistent_idle(struct wl_event_loop *loop,
+				  wl_event_loop_idle_func_t func,
+				  void *data);
+int wl_event_source_idle_rearm(struct wl_event_source *source);
 int wl_event_loop_get_fd(struct wl_event_loop *loop);
 
+/* Dispatch statistics, off by default.  Each source that's dispatched
+ * while stats are enabled counts its dispatches, the bytes its
+ * callback reports and a log-linear histogram of dispatch times; the
+ * loop keeps the same for whole iterations, not counting the time
+ * spent blocked.  Bucket i covers durations from
+ * wl_event_stats_bucket_floor(i) up to that of bucket i + 1. */
+#define WL_EVENT_STATS_BUCKETS 320
+
+struct wl_event_stats {
+	uint64_t count;
+	uint64_t bytes;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t histogram[WL_EVENT_STATS_BUCKETS];
+};
+
+void wl_event_loop_enable_stats(struct wl_event_loop *loop, int enable);
+void wl_event_loop_get_stats(struct wl_event_loop *loop,
+			     struct wl_event_stats *stats);
+void wl_event_source_get_stats(struct wl_event_source *source,
+			       struct wl_event_stats *stats);
+void wl_event_source_add_bytes(struct wl_event_source *source,
+			       uint64_t bytes);
+uint64_t wl_event_stats_bucket_floor(int bucket);
+
+/* The only loop entry point that's safe to call from any thread.  The
+ * task runs once, on the thread dispatching the loop. */
+int wl_event_loop_post_task(struct wl_event_loop *loop,
+			    wl_event_loop_task_func_t func, void *data);
+
 struct wl_client;
 struct wl_display;
 struct wl_input_device;
@@ -78,10 +155,20 @@ struct wl_input_device;
 struct wl_display *wl_display_create(void);
 void wl_display_destroy(struct wl_display *display);
 struct wl_event_loop *wl_display_get_event_loop(struct wl_display *display);
+/* Listen backlog for sockets added after this, 128 by default. */
+void wl_display_set_socket_backlog(struct wl_display *display, int backlog);
 int wl_display_add_socket(struct wl_display *display, const char *name);
 void wl_display_terminate(struct wl_display *display);
 void wl_display_run(struct wl_display *display);
 
+/* Write out the events queued for all clients.  This normally runs
+ * from an idle before the display's loop blocks, so it doesn't wake
+ * up on writable sockets.  An embedder that polls
+ * wl_event_loop_get_fd() from its own loop and posts events from its
+ * own callbacks must call this before it blocks, or the events sit in
+ * the out buffers until some unrelated input arrives. */
+void wl_display_flush_clients(struct wl_display *display);
+
 void wl_display_add_object(struct wl_display *display,
 			   struct wl_object *object);
 
@@ -99,12 +186,39 @@ void wl_display_remove_global(struct wl_display *display,
 struct wl_client *wl_client_create(struct wl_display *display, int fd);
 void wl_client_destroy(struct wl_client *client);
 void wl_client_flush(struct wl_client *client);
+void wl_client_cork(struct wl_client *client);
+void wl_client_uncork(struct wl_client *client);
+void wl_client_set_max_buffer_size(struct wl_client *client, size_t size);
 
 struct wl_resource *
 wl_client_add_object(struct wl_client *client,
 		     const struct wl_interface *interface,
 		     const void *implementation, uint32_t id, void *data);
 
+/* Called when an event doesn't fit in a client's output buffer, that
+ * is, the client has stopped reading and fallen behind by more than
+ * the max buffer size.  The handler decides whether to drop the event
+ * or disconnect the client; without a handler the client is
+ * disconnected. */
+enum wl_client_overflow_action {
+	WL_CLIENT_OVERFLOW_DROP,
+	WL_CLIENT_OVERFLOW_DISCONNECT
+};
+
+typedef enum wl_client_overflow_action
+(*wl_client_overflow_func_t)(struct wl_client *client,
+			     struct wl_resource *resource,
+			     uint32_t opcode, void *data);
+
+void wl_display_set_overflow_handler(struct wl_display *display,
+				     wl_client_overflow_func_t handler,
+				     void *data);
+
+/* Caps the number of requests dispatched per client per wakeup; the
+ * rest is picked up on a later loop iteration.  0 means unlimited. */
+void wl_display_set_request_budget(struct wl_display *display,
+				   uint32_t budget);
+
 struct wl_resource {
 	struct wl_object object;
 	void (*destroy)(struct wl_resource *resource);
@@ -216,8 +330,19 @@ struct wl_selection {
 
 void wl_resource_post_event(struct wl_resource *resource,
 			    uint32_t opcode, ...);
+void wl_resource_post_event_array(struct wl_resource *resource,
+				  uint32_t opcode, union wl_argument *args);
 void wl_resource_post_error(struct wl_resource *resource,
 			    uint32_t code, const char *msg, ...);
+
+/* Post the same event to every resource on a list linked through
+ * wl_resource.link, all of which must share an interface.  The event
+ * is marshalled once and copied to each client with only the object
+ * id patched, unless it carries objects, new ids or fds. */
+void wl_resource_list_post_event(struct wl_list *list,
+				 uint32_t opcode, ...);
+void wl_resource_list_post_event_array(struct wl_list *list, uint32_t opcode,
+				       union wl_argument *args);
 void wl_resource_post_no_memory(struct wl_resource *resource);
 
 int
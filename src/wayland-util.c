@@ -70,6 +70,18 @@ wl_list_empty(struct wl_list *list)
 	return list->next == list;
 }
 
+WL_EXPORT void
+wl_list_insert_list(struct wl_list *list, struct wl_list *other)
+{
+	if (wl_list_empty(other))
+		return;
+
+	other->next->prev = list;
+	other->prev->next = list->next;
+	list->next->prev = other->prev;
+	list->next = other->next;
+}
+
 WL_EXPORT void
 wl_array_init(struct wl_array *array)
 {
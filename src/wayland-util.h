@@ -44,10 +44,27 @@ extern "C" {
 	const typeof( ((type *)0)->member ) *__mptr = (ptr);	\
 	(type *)( (char *)__mptr - offsetof(type,member) );})
 
+typedef void (*wl_message_dispatch_func_t)(void (*func)(void),
+					   void * const *args);
+
+/* Precomputed from the signature by the scanner.  fixed_size is the
+ * size on the wire for messages without strings or arrays and 0 for
+ * variable sized messages. */
+struct wl_message_layout {
+	int arg_count;
+	int extra_size;
+	int fixed_size;
+};
+
+/* Scanner generated protocol code builds arrays of these, so adding
+ * fields breaks the ABI for code generated against older headers;
+ * regenerate it when the library soname changes. */
 struct wl_message {
 	const char *name;
 	const char *signature;
 	const struct wl_interface **types;
+	wl_message_dispatch_func_t dispatch;
+	const struct wl_message_layout *layout;
 };
 
 struct wl_interface {
@@ -115,6 +132,9 @@ void wl_list_insert(struct wl_list *list, struct wl_list *elm);
 void wl_list_remove(struct wl_list *elm);
 int wl_list_length(struct wl_list *list);
 int wl_list_empty(struct wl_list *list);
+/* Move all of other's entries in after list; other is left stale and
+ * must be reinitialized before reuse. */
+void wl_list_insert_list(struct wl_list *list, struct wl_list *other);
 
 #define __container_of(ptr, sample, member)				\
 	(void *)((char *)(ptr)	-					\
@@ -149,6 +169,18 @@ void wl_array_release(struct wl_array *array);
 void *wl_array_add(struct wl_array *array, int size);
 void wl_array_copy(struct wl_array *array, struct wl_array *source);
 
+/* One marshalled argument, selected by the corresponding signature
+ * character.  New objects ('n') are passed by id. */
+union wl_argument {
+	int32_t i;
+	uint32_t u;
+	const char *s;
+	struct wl_object *o;
+	uint32_t n;
+	struct wl_array *a;
+	int32_t h;
+};
+
 struct wl_map {
 	struct wl_array entries;
 	uint32_t free_list;